@@ -2,10 +2,53 @@
 #include <cmath>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <algorithm>
 #include <cfloat>
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <cstring>
+#include <charconv>
+#include <cstdio>
+#include <sstream>
+#include <map>
+#include <string_view>
+#include <memory>
+#include <cassert>
+#include <type_traits>
+#include <filesystem>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 struct Vector3 {
     float x, y, z;
@@ -27,6 +70,9 @@ struct Vector3 {
     Vector3 operator-() const { 
         return Vector3(-x, -y, -z);
     }
+    float operator[](int axis) const {
+        return axis == 0 ? x : (axis == 1 ? y : z);
+    }
     
     friend std::ostream& operator<<(std::ostream& os, const Vector3& v) {
         os << "(" << v.x << ", " << v.y << ", " << v.z << ")";
@@ -61,6 +107,11 @@ Vector3 reflect(const Vector3& incident, const Vector3& normal) {
     return incident - normal * (2 * dot(incident, normal));
 }
 
+// Component-wise product, for colors
+Vector3 multiply(const Vector3& a, const Vector3& b) {
+    return Vector3(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
 struct Ray {
     Vector3 origin;
     Vector3 direction;
@@ -70,290 +121,6164 @@ struct Ray {
     }
 };
 
-struct Triangle {
-    Vector3 v0, v1, v2;
-    Vector3 color;
-    bool doubleSided;
+// Pinhole camera. The default basis looks down -z with +y up.
+struct Camera {
+    Vector3 position;
+    Vector3 right = Vector3(1, 0, 0);
+    Vector3 up = Vector3(0, 1, 0);
+    Vector3 forward = Vector3(0, 0, -1);
+    
+    Camera(Vector3 pos = Vector3()) : position(pos) {}
+    static Camera lookAt(Vector3 position, Vector3 target);
+};
+
+// Affine transform: a 3x3 linear part and a translation in the last column
+struct Transform {
+    float m[3][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } };
+    
+    Vector3 point(const Vector3& p) const {
+        return Vector3(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                       m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                       m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+    Vector3 vector(const Vector3& v) const {
+        return Vector3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                       m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                       m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+    // Applied to the inverse transform, this takes normals from local to world space
+    Vector3 transposedVector(const Vector3& v) const {
+        return Vector3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                       m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                       m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+    Transform inverse() const;
+    // Uniform scale, then a rotation about +y, then the translation
+    static Transform make(Vector3 translation, float scale = 1.0f, float rotateYDegrees = 0.0f);
+};
+
+Transform Transform::inverse() const {
+    // Inverse of the linear part from the adjugate
+    float a = m[0][0], b = m[0][1], c = m[0][2];
+    float d = m[1][0], e = m[1][1], f = m[1][2];
+    float g = m[2][0], h = m[2][1], k = m[2][2];
+    float det = a * (e * k - f * h) - b * (d * k - f * g) + c * (d * h - e * g);
+    float inv = std::fabs(det) > 1e-20f ? 1.0f / det : 0.0f;
+    
+    Transform r;
+    r.m[0][0] = (e * k - f * h) * inv; r.m[0][1] = (c * h - b * k) * inv; r.m[0][2] = (b * f - c * e) * inv;
+    r.m[1][0] = (f * g - d * k) * inv; r.m[1][1] = (a * k - c * g) * inv; r.m[1][2] = (c * d - a * f) * inv;
+    r.m[2][0] = (d * h - e * g) * inv; r.m[2][1] = (b * g - a * h) * inv; r.m[2][2] = (a * e - b * d) * inv;
+    Vector3 t = r.vector(Vector3(m[0][3], m[1][3], m[2][3]));
+    r.m[0][3] = -t.x; r.m[1][3] = -t.y; r.m[2][3] = -t.z;
+    return r;
+}
+
+Transform Transform::make(Vector3 translation, float scale, float rotateYDegrees) {
+    float radians = rotateYDegrees * 3.14159265358979323846f / 180.0f;
+    float cs = std::cos(radians) * scale, sn = std::sin(radians) * scale;
+    Transform t;
+    t.m[0][0] = cs;  t.m[0][1] = 0;     t.m[0][2] = sn; t.m[0][3] = translation.x;
+    t.m[1][0] = 0;   t.m[1][1] = scale; t.m[1][2] = 0;  t.m[1][3] = translation.y;
+    t.m[2][0] = -sn; t.m[2][1] = 0;     t.m[2][2] = cs; t.m[2][3] = translation.z;
+    return t;
+}
+
+Camera Camera::lookAt(Vector3 position, Vector3 target) {
+    Camera camera(position);
+    Vector3 forward = normalize(target - position);
+    Vector3 right = cross(forward, Vector3(0, 1, 0));
+    if (length(right) < 1e-6f) return camera; // Straight up or down, keep the default basis
+    camera.forward = forward;
+    camera.right = normalize(right);
+    camera.up = cross(camera.right, forward);
+    return camera;
+}
+
+// Bump allocator for scratch memory that dies all at once, like one tile's ray
+// queues. allocate() carves pieces off a single block and reset() hands them all
+// back. Only reserve() and an overflowing allocate() touch the heap, so code that
+// reserves its worst case up front and resets between uses never allocates.
+class alignas(64) Arena {
+public:
+    static const size_t ALIGN = 64; // Every piece starts on its own cache line
+    
+    // Bytes that allocate<T>(count) takes, padding included
+    template <typename T>
+    static size_t bytesFor(size_t count) { return count * sizeof(T) + ALIGN; }
+    
+    // Grows the block to at least bytes. Drops everything allocated so far.
+    void reserve(size_t bytes);
+    void reset();
+    
+    // Uninitialized storage for count objects, which are never destroyed
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return (T*)allocateBytes(count * sizeof(T));
+    }
+    
+    size_t capacity() const { return size; }
+    
+private:
+    std::unique_ptr<unsigned char[]> block;
+    unsigned char* base = nullptr; // block rounded up to ALIGN
+    std::vector<std::unique_ptr<unsigned char[]>> overflow; // Pieces that did not fit since the last reset
+    size_t size = 0;
+    size_t used = 0;
+    size_t overflowBytes = 0;
+    
+    void* allocateBytes(size_t bytes);
+    static unsigned char* alignUp(unsigned char* p) { return p + (ALIGN - (uintptr_t)p % ALIGN) % ALIGN; }
+};
+
+void Arena::reserve(size_t bytes) {
+    reset();
+    if (bytes <= size) return;
+    block.reset(new unsigned char[bytes + ALIGN]);
+    base = alignUp(block.get());
+    size = bytes;
+}
+
+// Folds any overflow into one block big enough for it next time
+void Arena::reset() {
+    size_t peak = used + overflowBytes;
+    overflow.clear();
+    overflowBytes = 0;
+    used = 0;
+    if (peak > size) reserve(peak);
+}
+
+void* Arena::allocateBytes(size_t bytes) {
+    size_t start = (used + ALIGN - 1) / ALIGN * ALIGN;
+    if (start + bytes <= size) {
+        used = start + bytes;
+        return base + start;
+    }
+    overflow.emplace_back(new unsigned char[bytes + ALIGN]);
+    overflowBytes += bytes + ALIGN;
+    return alignUp(overflow.back().get());
+}
+
+// Fixed-capacity array in arena memory, for queues whose worst case is known
+template <typename T>
+struct ScratchArray {
+    T* items = nullptr;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    
+    void allocate(Arena& arena, uint32_t n) {
+        items = arena.allocate<T>(n);
+        count = 0;
+        capacity = n;
+    }
+    void clear() { count = 0; }
+    void resize(uint32_t n) {
+        assert(n <= capacity);
+        count = n;
+    }
+    void assign(uint32_t n, const T& value) {
+        resize(n);
+        std::fill(items, items + n, value);
+    }
+    void push_back(const T& item) {
+        assert(count < capacity);
+        items[count++] = item;
+    }
+    uint32_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T* data() { return items; }
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+    T* begin() { return items; }
+    T* end() { return items + count; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+};
+
+// Fixed set of worker threads. Each parallelFor() deals its items out to per-thread
+// queues; a thread pops from the back of its own queue and steals from the front of
+// the others once it runs dry. The calling thread takes part as thread 0.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threadCount = 0);
+    ~ThreadPool();
+    
+    unsigned size() const { return (unsigned)queues.size(); }
+    
+    // Scratch memory for whatever runs on that thread. parallelFor() callers own it
+    // for the duration of their job and reset it as they see fit.
+    Arena& arena(unsigned thread) { return arenas[thread]; }
+    // Sizes every thread's arena for at least bytes. Call it before parallelFor(),
+    // so the items themselves never allocate.
+    void reserveArenas(size_t bytes) {
+        for (Arena& a : arenas) a.reserve(bytes);
+    }
+    
+    // Runs fn(item, threadIndex) for every item in [0, count) and waits for all of them.
+    // Not reentrant - fn must not call parallelFor() on the same pool.
+    void parallelFor(uint32_t count, const std::function<void(uint32_t, unsigned)>& fn);
+    
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<uint32_t> items;
+    };
+    
+    std::vector<std::thread> workers;
+    std::deque<WorkQueue> queues;
+    std::deque<Arena> arenas;
+    const std::function<void(uint32_t, unsigned)>* job = nullptr;
+    std::atomic<uint32_t> remaining{0};
+    uint64_t generation = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    
+    bool popItem(unsigned thread, uint32_t& item);
+    void runItems(unsigned thread);
+    void workerLoop(unsigned thread);
+};
+
+ThreadPool::ThreadPool(unsigned threadCount) {
+    if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+    queues.resize(threadCount);
+    arenas.resize(threadCount);
+    for (unsigned i = 1; i < threadCount; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+bool ThreadPool::popItem(unsigned thread, uint32_t& item) {
+    {
+        WorkQueue& own = queues[thread];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.items.empty()) {
+            item = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+    for (unsigned i = 1; i < queues.size(); i++) {
+        WorkQueue& victim = queues[(thread + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.items.empty()) {
+            item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::runItems(unsigned thread) {
+    uint32_t item;
+    while (popItem(thread, item)) {
+        (*job)(item, thread);
+        if (remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::workerLoop(unsigned thread) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        runItems(thread);
+    }
+}
+
+void ThreadPool::parallelFor(uint32_t count, const std::function<void(uint32_t, unsigned)>& fn) {
+    if (count == 0) return;
+    
+    job = &fn;
+    remaining = count;
+    
+    // Contiguous blocks per thread keep neighbouring items (tiles, chunks) on one core
+    unsigned threads = size();
+    for (unsigned t = 0; t < threads; t++) {
+        uint32_t begin = (uint32_t)((uint64_t)count * t / threads);
+        uint32_t end = (uint32_t)((uint64_t)count * (t + 1) / threads);
+        std::lock_guard<std::mutex> lock(queues[t].mutex);
+        // Owner pops from the back, so push in reverse to work front to back
+        for (uint32_t i = end; i > begin; i--) queues[t].items.push_back(i - 1);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation++;
+    }
+    wake.notify_all();
+    
+    runItems(0);
+    
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return remaining.load() == 0; });
+}
+
+// Ray and traversal counters. Each thread counts into its own threadStats and
+// the render loop folds them into a FrameStats slot per tile, so the hot path
+// never touches shared memory. Build with -DRT_ENABLE_STATS=0 to compile the
+// counters out entirely.
+#ifndef RT_ENABLE_STATS
+#define RT_ENABLE_STATS 1
+#endif
+
+// Counting heap allocations replaces the global operator new, so it is a debug
+// build of its own: -DRT_COUNT_ALLOCATIONS=1, on top of the stats. Without it
+// the program keeps the standard allocator and tiles always count 0.
+#ifndef RT_COUNT_ALLOCATIONS
+#define RT_COUNT_ALLOCATIONS 0
+#endif
+#define RT_ALLOCATION_STATS (RT_ENABLE_STATS && RT_COUNT_ALLOCATIONS)
+
+struct alignas(64) RayStats {
+    uint64_t primaryRays = 0;
+    uint64_t shadowRays = 0;
+    uint64_t reflectionRays = 0;
+    uint64_t triangleTests = 0;
+    uint64_t nodeVisits = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t allocations = 0; // Heap allocations made by render tiles, which should stay 0
+    
+    uint64_t totalRays() const { return primaryRays + shadowRays + reflectionRays; }
+    uint64_t cost() const { return triangleTests + nodeVisits; }
+    void merge(const RayStats& other) {
+        primaryRays += other.primaryRays;
+        shadowRays += other.shadowRays;
+        reflectionRays += other.reflectionRays;
+        triangleTests += other.triangleTests;
+        nodeVisits += other.nodeVisits;
+        hits += other.hits;
+        misses += other.misses;
+        allocations += other.allocations;
+    }
+};
+
+thread_local RayStats threadStats;
+
+#if RT_ENABLE_STATS
+#define RT_STAT_ADD(field, n) (threadStats.field += (n))
+#else
+#define RT_STAT_ADD(field, n) ((void)0)
+#endif
+
+// In the allocation counting build the global operator new counts every heap
+// allocation of the thread that makes it, so the render loop can check that its
+// tiles made none. Aligned new is not replaced and not counted.
+thread_local uint64_t threadAllocations = 0;
+
+#if RT_ALLOCATION_STATS
+// GCC inlines these into callers and then takes free() for a mismatch with new
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(size_t size) {
+    threadAllocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+// Per-thread totals for one frame, merged with total() once it is done
+struct FrameStats {
+    std::vector<RayStats> perThread;
+    
+    explicit FrameStats(unsigned threads) : perThread(threads) {}
+    RayStats total() const {
+        RayStats sum;
+        for (const auto& stats : perThread) sum.merge(stats);
+        return sum;
+    }
+};
+
+// Surface properties, indexed from the scene's material table
+struct Material {
+    Vector3 color;                  // Diffuse (Kd)
+    float reflectivity = 0.0f;      // Weight of the mirror bounce; 0 spawns no reflection ray
+    float specularExponent = 32.0f; // Ns
+};
+
+// Indexed triangle mesh - vertices are shared between faces and each face is
+// three 32-bit indices into them. Faces use material unless triangleMaterials
+// gives each one a 16-bit offset into the mesh's materialCount materials.
+struct Mesh {
+    std::vector<Vector3> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<uint16_t> triangleMaterials;
+    uint32_t material = 0;
+    uint32_t materialCount = 1; // Scene materials [material, material + materialCount) belong to this mesh
+    bool doubleSided = false;
+    bool tracksLight = false; // Moves with the light (the indicator), so kept out of the G-buffer
     
-    Triangle(Vector3 a, Vector3 b, Vector3 c, Vector3 col, bool ds = false)
-        : v0(a), v1(b), v2(c), color(col), doubleSided(ds) {}
+    uint32_t triangleCount() const { return (uint32_t)(indices.size() / 3); }
+    const Vector3& vertex(uint32_t tri, int corner) const { return vertices[indices[tri * 3 + corner]]; }
+    uint32_t materialOf(uint32_t tri) const { return triangleMaterials.empty() ? material : material + triangleMaterials[tri]; }
+    void addTriangle(const Vector3& a, const Vector3& b, const Vector3& c);
+};
+
+void Mesh::addTriangle(const Vector3& a, const Vector3& b, const Vector3& c) {
+    uint32_t base = (uint32_t)vertices.size();
+    vertices.push_back(a);
+    vertices.push_back(b);
+    vertices.push_back(c);
+    indices.push_back(base);
+    indices.push_back(base + 1);
+    indices.push_back(base + 2);
+}
+
+// One triangle of one mesh
+struct PrimRef {
+    uint32_t mesh;
+    uint32_t triangle;
 };
 
+const uint32_t NO_PRIMITIVE = UINT32_MAX;
+
 struct HitRecord {
     Vector3 position;
     Vector3 normal;
     float distance;
-    const Triangle* triangle;
+    float u, v;         // Barycentrics of the hit
+    uint32_t primitive; // Leaf-order slot in the BVH
+    uint32_t material;
+    uint32_t instance;  // Scene instance the hit is on, NO_PRIMITIVE for the flat geometry
+    
+    HitRecord() : distance(FLT_MAX), u(0), v(0), primitive(NO_PRIMITIVE), material(0), instance(NO_PRIMITIVE) {}
+};
+
+const size_t SIMD_PADDING = 16;
+
+// Intersection-ready triangles, preprocessed once after loading. Stored as
+// structure-of-arrays so the kernels only pull in the fields they test. Every
+// array carries SIMD_PADDING zeroed entries past the end, so a full-width
+// vector load starting at any triangle stays in bounds.
+struct TriangleSoA {
+    std::vector<float> v0x, v0y, v0z;
+    std::vector<float> e1x, e1y, e1z;
+    std::vector<float> e2x, e2y, e2z;
+    std::vector<float> nx, ny, nz;     // Unit face normal
+    std::vector<uint8_t> doubleSided;
+    size_t count = 0;
     
-    HitRecord() : distance(FLT_MAX), triangle(nullptr) {}
+    size_t size() const { return count; }
+    void build(const std::vector<Mesh>& meshes, const std::vector<PrimRef>& prims);
+    // Rewrites slot i from the mesh's current vertices
+    void set(uint32_t i, const Mesh& mesh, uint32_t triangle);
+    Vector3 normal(uint32_t i) const { return Vector3(nx[i], ny[i], nz[i]); }
 };
 
+void TriangleSoA::build(const std::vector<Mesh>& meshes, const std::vector<PrimRef>& prims) {
+    size_t n = prims.size();
+    count = n;
+    for (auto* arr : { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &nx, &ny, &nz }) {
+        arr->assign(n + SIMD_PADDING, 0.0f);
+    }
+    doubleSided.assign(n + SIMD_PADDING, 0);
+    
+    for (size_t i = 0; i < n; i++) set((uint32_t)i, meshes[prims[i].mesh], prims[i].triangle);
+}
+
+void TriangleSoA::set(uint32_t i, const Mesh& mesh, uint32_t triangle) {
+    const Vector3& v0 = mesh.vertex(triangle, 0);
+    Vector3 edge1 = mesh.vertex(triangle, 1) - v0;
+    Vector3 edge2 = mesh.vertex(triangle, 2) - v0;
+    Vector3 normal = normalize(cross(edge1, edge2));
+    v0x[i] = v0.x;     v0y[i] = v0.y;     v0z[i] = v0.z;
+    e1x[i] = edge1.x;  e1y[i] = edge1.y;  e1z[i] = edge1.z;
+    e2x[i] = edge2.x;  e2y[i] = edge2.y;  e2z[i] = edge2.z;
+    nx[i] = normal.x;  ny[i] = normal.y;  nz[i] = normal.z;
+    doubleSided[i] = mesh.doubleSided;
+}
+
 const float EPSILON = 1e-5f;
 const float PI = 3.14159265358979323846f;
 
-bool intersectTriangle(const Triangle& tri, const Ray& ray, HitRecord& hit) {
-    Vector3 edge1 = tri.v1 - tri.v0;
-    Vector3 edge2 = tri.v2 - tri.v0;
+// Which triangles of a run get backface culling. Most leaves hold one sidedness
+// only (see BVH::leafCulling), so their kernels are compiled for it and never
+// read the per-triangle flag; PerTriangle is for the leaves that mix both.
+enum class Culling : uint8_t { None, Back, PerTriangle };
+
+// Moller-Trumbore test shared by every scalar kernel. Fills t and the
+// barycentrics when the ray hits in (EPSILON, tMax). doubleSided is only read
+// for Culling::PerTriangle.
+template <Culling C = Culling::PerTriangle>
+inline bool mollerTrumbore(const Vector3& v0, const Vector3& edge1, const Vector3& edge2, bool doubleSided,
+                           const Ray& ray, float tMax, float& t, float& u, float& v) {
     Vector3 h = cross(ray.direction, edge2);
     float a = dot(edge1, h);
     
     // Backface culling - only for single-sided triangles
-    if (!tri.doubleSided && a < EPSILON && a > -EPSILON)
+    const bool cull = C == Culling::Back || (C == Culling::PerTriangle && !doubleSided);
+    if (cull && a < EPSILON && a > -EPSILON)
         return false;
         
     float f = 1.0f / a;
-    Vector3 s = ray.origin - tri.v0;
-    float u = f * dot(s, h);
+    Vector3 s = ray.origin - v0;
+    u = f * dot(s, h);
     
     if (u < 0.0 || u > 1.0)
         return false;
         
     Vector3 q = cross(s, edge1);
-    float v = f * dot(ray.direction, q);
+    v = f * dot(ray.direction, q);
     
     if (v < 0.0 || u + v > 1.0)
         return false;
         
-    float t = f * dot(edge2, q);
-    if (t > EPSILON && t < hit.distance) {
-        hit.distance = t;
-        hit.position = ray.pointAt(t);
-        
-        // Compute normal - flip for backfaces if double-sided
-        hit.normal = normalize(cross(edge1, edge2));
-        if (tri.doubleSided && dot(hit.normal, ray.direction) > 0) {
-            hit.normal = -hit.normal;
-        }
-        
-        hit.triangle = &tri;
-        return true;
-    }
+    t = f * dot(edge2, q);
+    return t > EPSILON && t < tMax;
+}
+
+// Test against one preprocessed triangle. Only records t, the barycentrics and
+// the primitive - position and normal are filled in once the closest hit is
+// known (see BVH::finalizeHit).
+template <Culling C = Culling::PerTriangle>
+bool intersectTriangle(const TriangleSoA& tris, uint32_t i, const Ray& ray, HitRecord& hit) {
+    Vector3 v0(tris.v0x[i], tris.v0y[i], tris.v0z[i]);
+    Vector3 edge1(tris.e1x[i], tris.e1y[i], tris.e1z[i]);
+    Vector3 edge2(tris.e2x[i], tris.e2y[i], tris.e2z[i]);
+    float t, u, v;
+    if (!mollerTrumbore<C>(v0, edge1, edge2, C == Culling::PerTriangle && tris.doubleSided[i], ray, hit.distance, t, u, v))
+        return false;
     
-    return false;
+    hit.distance = t;
+    hit.u = u;
+    hit.v = v;
+    hit.primitive = i;
+    return true;
+}
+
+// Occlusion-only variant - no hit record, just "is there a blocker before tMax"
+template <Culling C = Culling::PerTriangle>
+bool occludesTriangle(const TriangleSoA& tris, uint32_t i, const Ray& ray, float tMax) {
+    Vector3 v0(tris.v0x[i], tris.v0y[i], tris.v0z[i]);
+    Vector3 edge1(tris.e1x[i], tris.e1y[i], tris.e1z[i]);
+    Vector3 edge2(tris.e2x[i], tris.e2y[i], tris.e2z[i]);
+    float t, u, v;
+    return mollerTrumbore<C>(v0, edge1, edge2, C == Culling::PerTriangle && tris.doubleSided[i], ray, tMax, t, u, v);
 }
 
-Vector3 trace(const Ray& ray, const std::vector<Triangle>& triangles, int depth = 0) {
-    if (depth > 3) return Vector3(0, 0, 0); // Prevent infinite recursion
+// Same tests reading straight from a mesh's index buffer - no preprocessed copy.
+// slot is what gets recorded as the hit primitive.
+bool intersectTriangle(const Mesh& mesh, uint32_t tri, uint32_t slot, const Ray& ray, HitRecord& hit) {
+    const Vector3& v0 = mesh.vertex(tri, 0);
+    float t, u, v;
+    if (!mollerTrumbore(v0, mesh.vertex(tri, 1) - v0, mesh.vertex(tri, 2) - v0, mesh.doubleSided,
+                        ray, hit.distance, t, u, v))
+        return false;
     
-    HitRecord closestHit;
-    for (const auto& tri : triangles) {
-        HitRecord hit;
-        if (intersectTriangle(tri, ray, hit)) {
-            if (hit.distance < closestHit.distance) {
-                closestHit = hit;
-            }
+    hit.distance = t;
+    hit.u = u;
+    hit.v = v;
+    hit.primitive = slot;
+    return true;
+}
+
+bool occludesTriangle(const Mesh& mesh, uint32_t tri, const Ray& ray, float tMax) {
+    const Vector3& v0 = mesh.vertex(tri, 0);
+    float t, u, v;
+    return mollerTrumbore(v0, mesh.vertex(tri, 1) - v0, mesh.vertex(tri, 2) - v0, mesh.doubleSided,
+                          ray, tMax, t, u, v);
+}
+
+// Leaf kernels test one ray against a contiguous run of triangles. The scalar
+// versions loop over intersectTriangle(); the SIMD versions test 4/8/16
+// triangles per step and are picked at startup from what the CPU supports.
+// Each comes in one instantiation per Culling, indexed by it.
+enum class SimdLevel { Scalar, SSE41, AVX2, AVX512 };
+
+typedef bool (*IntersectLeafKernel)(const TriangleSoA&, uint32_t first, uint32_t count, const Ray&, HitRecord&);
+typedef bool (*OccludedLeafKernel)(const TriangleSoA&, uint32_t first, uint32_t count, const Ray&, float tMax);
+
+struct LeafKernels {
+    const char* name;
+    uint32_t width; // Triangles per step, used by the SAH leaf cost
+    IntersectLeafKernel intersect[3];
+    OccludedLeafKernel occluded[3];
+};
+
+template <Culling C>
+bool intersectLeafScalar(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, HitRecord& hit) {
+    bool found = false;
+    for (uint32_t i = first; i < first + count; i++) {
+        if (intersectTriangle<C>(tris, i, ray, hit)) found = true;
+    }
+    return found;
+}
+
+template <Culling C>
+bool occludedLeafScalar(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, float tMax) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (occludesTriangle<C>(tris, i, ray, tMax)) return true;
+    }
+    return false;
+}
+
+// Takes the nearest of the lanes set in mask (all of which already beat hit.distance)
+inline void pickClosestLane(uint32_t mask, const float* ts, const float* us, const float* vs,
+                            uint32_t base, HitRecord& hit) {
+    for (uint32_t lane = 0; mask; lane++, mask >>= 1) {
+        if ((mask & 1) && ts[lane] < hit.distance) {
+            hit.distance = ts[lane];
+            hit.u = us[lane];
+            hit.v = vs[lane];
+            hit.primitive = base + lane;
         }
     }
+}
 
-    if (!closestHit.triangle) 
-        return Vector3(0.2f, 0.7f, 0.8f); // bg color
+inline uint32_t laneMask(uint32_t remaining, uint32_t width) {
+    return remaining >= width ? (width == 32 ? ~0u : (1u << width) - 1) : (1u << remaining) - 1;
+}
 
-    // Material properties
-    Vector3 materialColor = closestHit.triangle->color;
-    float ambientStrength = 0.3f;
-    Vector3 ambient = materialColor * ambientStrength;
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_HAVE_X86_SIMD 1
+#include <immintrin.h>
+// Contraction into FMA is kept off so the vector kernels report the same hits as the scalar one
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RT_TARGET(isa)
+#elif defined(__clang__)
+#define RT_TARGET(isa) __attribute__((target(isa)))
+#else
+#define RT_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#endif
 
-    // Light settings
-    Vector3 lightPos(2, 5, 1);
-    Vector3 lightDir = normalize(lightPos - closestHit.position);
-    Vector3 viewDir = normalize(ray.origin - closestHit.position);
-    Vector3 reflectDir = reflect(-lightDir, closestHit.normal);
+// One Moller-Trumbore step over 4 triangles. Lanes past the end of the leaf read
+// into TriangleSoA's padding; callers mask them off.
+template <Culling C>
+RT_TARGET("sse4.1")
+uint32_t testTrianglesSSE41(const TriangleSoA& tris, uint32_t i, const Ray& ray, float tMax,
+                            float* ts, float* us, float* vs) {
+    const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    const __m128 eps = _mm_set1_ps(EPSILON), one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
     
-    // Diffuse lighting
-    float diff = std::max(0.0f, dot(closestHit.normal, lightDir));
-    Vector3 diffuse = materialColor * diff;
+    __m128 e1x = _mm_loadu_ps(&tris.e1x[i]), e1y = _mm_loadu_ps(&tris.e1y[i]), e1z = _mm_loadu_ps(&tris.e1z[i]);
+    __m128 e2x = _mm_loadu_ps(&tris.e2x[i]), e2y = _mm_loadu_ps(&tris.e2y[i]), e2z = _mm_loadu_ps(&tris.e2z[i]);
     
-    // Specular lighting
-    float specularStrength = 0.5f;
-    float spec = pow(std::max(0.0f, dot(viewDir, reflectDir)), 32);
-    Vector3 specular = Vector3(1,1,1) * spec * specularStrength;
+    __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
     
-    // Shadow check
-    Ray shadowRay;
-    shadowRay.origin = closestHit.position + closestHit.normal * EPSILON;
-    shadowRay.direction = lightDir;
-    bool inShadow = false;
-    
-    for (const auto& tri : triangles) {
-        HitRecord shadowHit;
-        if (intersectTriangle(tri, shadowRay, shadowHit)) {
-            if (shadowHit.distance > 0 && shadowHit.distance < length(lightPos - closestHit.position)) {
-                inShadow = true;
-                break;
-            }
+    __m128 reject = _mm_setzero_ps();
+    if constexpr (C != Culling::None) {
+        reject = _mm_and_ps(_mm_cmplt_ps(a, eps), _mm_cmpgt_ps(a, _mm_set1_ps(-EPSILON)));
+        if constexpr (C == Culling::PerTriangle) {
+            int32_t dsBytes;
+            std::memcpy(&dsBytes, &tris.doubleSided[i], sizeof(dsBytes));
+            __m128 ds = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(dsBytes)), _mm_setzero_si128()));
+            reject = _mm_andnot_ps(ds, reject);
         }
     }
     
-    // Reflection for shiny surfaces
-    Vector3 reflection(0,0,0);
-    if (depth < 3 && materialColor.x > 0.7f) {
-        Ray reflectRay;
-        reflectRay.origin = closestHit.position + closestHit.normal * EPSILON;
-        reflectRay.direction = reflect(ray.direction, closestHit.normal);
-        reflection = trace(reflectRay, triangles, depth+1) * 0.5f;
+    __m128 f = _mm_div_ps(one, a);
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&tris.v0x[i]));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&tris.v0y[i]));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&tris.v0z[i]));
+    __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+    reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+    
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+    reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+    
+    __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+    __m128 good = _mm_andnot_ps(reject, _mm_and_ps(_mm_cmpgt_ps(t, eps), _mm_cmplt_ps(t, _mm_set1_ps(tMax))));
+    
+    if (ts) {
+        _mm_storeu_ps(ts, t);
+        _mm_storeu_ps(us, u);
+        _mm_storeu_ps(vs, v);
     }
+    return (uint32_t)_mm_movemask_ps(good);
+}
 
-    // Combine lighting
-    Vector3 result = ambient;
-    if (!inShadow) {
-        result = result + diffuse + specular;
+// Same step over 8 triangles
+template <Culling C>
+RT_TARGET("avx2")
+uint32_t testTrianglesAVX2(const TriangleSoA& tris, uint32_t i, const Ray& ray, float tMax,
+                           float* ts, float* us, float* vs) {
+    const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 eps = _mm256_set1_ps(EPSILON), one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+    
+    __m256 e1x = _mm256_loadu_ps(&tris.e1x[i]), e1y = _mm256_loadu_ps(&tris.e1y[i]), e1z = _mm256_loadu_ps(&tris.e1z[i]);
+    __m256 e2x = _mm256_loadu_ps(&tris.e2x[i]), e2y = _mm256_loadu_ps(&tris.e2y[i]), e2z = _mm256_loadu_ps(&tris.e2z[i]);
+    
+    __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+    
+    __m256 reject = _mm256_setzero_ps();
+    if constexpr (C != Culling::None) {
+        reject = _mm256_and_ps(_mm256_cmp_ps(a, eps, _CMP_LT_OQ), _mm256_cmp_ps(a, _mm256_set1_ps(-EPSILON), _CMP_GT_OQ));
+        if constexpr (C == Culling::PerTriangle) {
+            __m128i dsBytes = _mm_loadl_epi64((const __m128i*)&tris.doubleSided[i]);
+            __m256 ds = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(dsBytes), _mm256_setzero_si256()));
+            reject = _mm256_andnot_ps(ds, reject);
+        }
     }
     
-    return result + reflection;
-}
-
-Ray computePrimRay(int x, int y, int width, int height, Vector3 cameraPos) {
-    float aspect = width / (float)height;
-    float scale = tan(60 * 0.5 * PI / 180);
+    __m256 f = _mm256_div_ps(one, a);
+    __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&tris.v0x[i]));
+    __m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&tris.v0y[i]));
+    __m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&tris.v0z[i]));
+    __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+    reject = _mm256_or_ps(reject, _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(u, one, _CMP_GT_OQ)));
     
-    float px = (2 * ((x + 0.5) / width) - 1) * aspect * scale;
-    float py = (1 - 2 * ((y + 0.5) / height)) * scale;
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+    reject = _mm256_or_ps(reject, _mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ),
+                                               _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ)));
     
-    Vector3 direction(px, py, -1);
-    direction = normalize(direction);
+    __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+    __m256 good = _mm256_andnot_ps(reject, _mm256_and_ps(_mm256_cmp_ps(t, eps, _CMP_GT_OQ),
+                                                         _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ)));
     
-    return Ray{cameraPos, direction};
+    if (ts) {
+        _mm256_storeu_ps(ts, t);
+        _mm256_storeu_ps(us, u);
+        _mm256_storeu_ps(vs, v);
+    }
+    return (uint32_t)_mm256_movemask_ps(good);
 }
 
-std::vector<Triangle> loadOBJ(const std::string& path, Vector3 color, float scale = 1.0f, 
-                                 Vector3 offset = Vector3(0,0,0), bool doubleSided = false) {
-    std::vector<Triangle> triangles;
-    std::vector<Vector3> vertices;
+// Same step over 16 triangles, using mask registers
+template <Culling C>
+RT_TARGET("avx512f")
+uint32_t testTrianglesAVX512(const TriangleSoA& tris, uint32_t i, const Ray& ray, float tMax,
+                             float* ts, float* us, float* vs) {
+    const __m512 dx = _mm512_set1_ps(ray.direction.x), dy = _mm512_set1_ps(ray.direction.y), dz = _mm512_set1_ps(ray.direction.z);
+    const __m512 eps = _mm512_set1_ps(EPSILON), one = _mm512_set1_ps(1.0f), zero = _mm512_setzero_ps();
     
-    std::ifstream file(path);
-    if (!file) {
-        std::cerr << "Error opening OBJ file: " << path << "\n";
-        return triangles;
-    }
+    __m512 e1x = _mm512_loadu_ps(&tris.e1x[i]), e1y = _mm512_loadu_ps(&tris.e1y[i]), e1z = _mm512_loadu_ps(&tris.e1z[i]);
+    __m512 e2x = _mm512_loadu_ps(&tris.e2x[i]), e2y = _mm512_loadu_ps(&tris.e2y[i]), e2z = _mm512_loadu_ps(&tris.e2z[i]);
     
-    std::string line;
-    while (std::getline(file, line)) {
-        if (line.empty() || line[0] == '#') continue;
-        
-        std::istringstream iss(line);
-        std::string type;
-        iss >> type;
-        
-        if (type == "v") {
-            float x, y, z;
-            iss >> x >> y >> z;
-            vertices.push_back(Vector3(x, y, z));
-        }
-        else if (type == "f") {
-            std::string v[3];
-            iss >> v[0] >> v[1] >> v[2];
-            
-            int indices[3];
-            bool valid = true;
-            
-            for (int i = 0; i < 3; i++) {
-                size_t pos = v[i].find('/');
-                if (pos != std::string::npos) {
-                    v[i] = v[i].substr(0, pos);
-                }
-                
-                try {
-                    indices[i] = std::stoi(v[i]) - 1;
-                } catch (...) {
-                    valid = false;
-                    break;
-                }
-            }
-            
-            if (valid && indices[0] >= 0 && indices[0] < vertices.size() &&
-                         indices[1] >= 0 && indices[1] < vertices.size() &&
-                         indices[2] >= 0 && indices[2] < vertices.size()) {
-                Vector3 v0 = vertices[indices[0]] * scale + offset;
-                Vector3 v1 = vertices[indices[1]] * scale + offset;
-                Vector3 v2 = vertices[indices[2]] * scale + offset;
-                triangles.push_back(Triangle(v0, v1, v2, color, doubleSided));
-            }
+    __m512 hx = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+    __m512 hy = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+    __m512 hz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+    __m512 a = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, hx), _mm512_mul_ps(e1y, hy)), _mm512_mul_ps(e1z, hz));
+    
+    __mmask16 reject = 0;
+    if constexpr (C != Culling::None) {
+        reject = _mm512_cmp_ps_mask(a, eps, _CMP_LT_OQ) & _mm512_cmp_ps_mask(a, _mm512_set1_ps(-EPSILON), _CMP_GT_OQ);
+        if constexpr (C == Culling::PerTriangle) {
+            __m512i dsLanes = _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128((const __m128i*)&tris.doubleSided[i]));
+            reject = _mm512_kandn(_mm512_test_epi32_mask(dsLanes, dsLanes), reject);
         }
     }
     
-    std::cerr << "Loaded " << triangles.size() << " triangles from " << path << "\n";
-    return triangles;
-}
-
-int main() {
-    const int width = 800;
-    const int height = 600;
+    __m512 f = _mm512_div_ps(one, a);
+    __m512 sx = _mm512_sub_ps(_mm512_set1_ps(ray.origin.x), _mm512_loadu_ps(&tris.v0x[i]));
+    __m512 sy = _mm512_sub_ps(_mm512_set1_ps(ray.origin.y), _mm512_loadu_ps(&tris.v0y[i]));
+    __m512 sz = _mm512_sub_ps(_mm512_set1_ps(ray.origin.z), _mm512_loadu_ps(&tris.v0z[i]));
+    __m512 u = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(sx, hx), _mm512_mul_ps(sy, hy)), _mm512_mul_ps(sz, hz)));
+    reject |= _mm512_cmp_ps_mask(u, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(u, one, _CMP_GT_OQ);
     
-    std::vector<Vector3> image(width * height);
-    std::vector<Triangle> triangles;
+    __m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(sz, e1y));
+    __m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(sx, e1z));
+    __m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(sy, e1x));
+    __m512 v = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)));
+    reject |= _mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(_mm512_add_ps(u, v), one, _CMP_GT_OQ);
     
-    // Position camera properly
-    Vector3 cameraPos(0, 1.5, 4);
+    __m512 t = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)));
+    __mmask16 good = _mm512_kandn(reject, _mm512_cmp_ps_mask(t, eps, _CMP_GT_OQ) &
+                                          _mm512_cmp_ps_mask(t, _mm512_set1_ps(tMax), _CMP_LT_OQ));
     
-    // Load obj
-    std::vector<Triangle> cylinder = loadOBJ("Neshto.obj", 
-        Vector3(0.8f, 0.5f, 0.2f),  // Bronze color
-        1.0f, 
-        Vector3(0, 0, -2),
-        true); // Double-sided triangles
+    if (ts) {
+        _mm512_storeu_ps(ts, t);
+        _mm512_storeu_ps(us, u);
+        _mm512_storeu_ps(vs, v);
+    }
+    return (uint32_t)good;
+}
+
+typedef uint32_t (*TriangleStep)(const TriangleSoA&, uint32_t, const Ray&, float, float*, float*, float*);
+
+// Wraps a step function into closest-hit and any-hit leaf kernels
+template <uint32_t Width, TriangleStep Test>
+bool intersectLeafSimd(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, HitRecord& hit) {
+    bool found = false;
+    float ts[Width], us[Width], vs[Width];
+    for (uint32_t i = first; i < first + count; i += Width) {
+        uint32_t mask = Test(tris, i, ray, hit.distance, ts, us, vs) & laneMask(first + count - i, Width);
+        if (mask) {
+            pickClosestLane(mask, ts, us, vs, i, hit);
+            found = true;
+        }
+    }
+    return found;
+}
+
+template <uint32_t Width, TriangleStep Test>
+bool occludedLeafSimd(const TriangleSoA& tris, uint32_t first, uint32_t count, const Ray& ray, float tMax) {
+    for (uint32_t i = first; i < first + count; i += Width) {
+        if (Test(tris, i, ray, tMax, nullptr, nullptr, nullptr) & laneMask(first + count - i, Width))
+            return true;
+    }
+    return false;
+}
+
+// Kernel table of one step width, from its Culling::None, Back and PerTriangle steps
+template <uint32_t Width, TriangleStep None, TriangleStep Back, TriangleStep Mixed>
+LeafKernels simdKernels(const char* name) {
+    return { name, Width,
+             { intersectLeafSimd<Width, None>, intersectLeafSimd<Width, Back>, intersectLeafSimd<Width, Mixed> },
+             { occludedLeafSimd<Width, None>, occludedLeafSimd<Width, Back>, occludedLeafSimd<Width, Mixed> } };
+}
+#endif
+
+SimdLevel detectSimdLevel() {
+#if defined(RT_HAVE_X86_SIMD) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] >> 19) & 1;
+    bool osxsave = (info[2] >> 27) & 1;
+    if (!sse41) return SimdLevel::Scalar;
+    if (!osxsave || maxLeaf < 7) return SimdLevel::SSE41;
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    if ((xcr0 & 0xE6) == 0xE6 && ((info[1] >> 16) & 1)) return SimdLevel::AVX512;
+    if ((xcr0 & 0x6) == 0x6 && ((info[1] >> 5) & 1)) return SimdLevel::AVX2;
+    return SimdLevel::SSE41;
+#elif defined(RT_HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE41;
+    return SimdLevel::Scalar;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+LeafKernels selectLeafKernels(SimdLevel level) {
+#ifdef RT_HAVE_X86_SIMD
+    switch (level) {
+    case SimdLevel::AVX512:
+        return simdKernels<16, testTrianglesAVX512<Culling::None>, testTrianglesAVX512<Culling::Back>,
+                           testTrianglesAVX512<Culling::PerTriangle>>("avx512");
+    case SimdLevel::AVX2:
+        return simdKernels<8, testTrianglesAVX2<Culling::None>, testTrianglesAVX2<Culling::Back>,
+                           testTrianglesAVX2<Culling::PerTriangle>>("avx2");
+    case SimdLevel::SSE41:
+        return simdKernels<4, testTrianglesSSE41<Culling::None>, testTrianglesSSE41<Culling::Back>,
+                           testTrianglesSSE41<Culling::PerTriangle>>("sse4.1");
+    default:
+        break;
+    }
+#endif
+    (void)level;
+    return { "scalar", 1,
+             { intersectLeafScalar<Culling::None>, intersectLeafScalar<Culling::Back>, intersectLeafScalar<Culling::PerTriangle> },
+             { occludedLeafScalar<Culling::None>, occludedLeafScalar<Culling::Back>, occludedLeafScalar<Culling::PerTriangle> } };
+}
+
+// Active kernels, chosen from the host CPU at startup
+LeafKernels leafKernels = selectLeafKernels(detectSimdLevel());
+
+struct AABB {
+    Vector3 min, max;
     
-    triangles.insert(triangles.end(), cylinder.begin(), cylinder.end());
+    AABB() : min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
     
-    // Add floor
-    Vector3 floorColor(0.3f, 0.6f, 0.3f);
-    triangles.push_back(Triangle(
-        Vector3(-5, -1, -5), Vector3(5, -1, -5), Vector3(5, -1, 5), floorColor, true));
-    triangles.push_back(Triangle(
-        Vector3(-5, -1, -5), Vector3(5, -1, 5), Vector3(-5, -1, 5), floorColor, true));
+    void grow(const Vector3& p) {
+        min = Vector3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vector3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+    void grow(const AABB& b) {
+        if (b.min.x > b.max.x) return; // Empty box
+        grow(b.min);
+        grow(b.max);
+    }
+    float area() const {
+        Vector3 e = max - min;
+        if (e.x < 0) return 0.0f; // Empty box
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+// Slab test - returns entry distance, or FLT_MAX on a miss
+float intersectAABB(const AABB& box, const Ray& ray, const Vector3& invDir, float tMax) {
+    float tx1 = (box.min.x - ray.origin.x) * invDir.x, tx2 = (box.max.x - ray.origin.x) * invDir.x;
+    float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
+    float ty1 = (box.min.y - ray.origin.y) * invDir.y, ty2 = (box.max.y - ray.origin.y) * invDir.y;
+    tmin = std::max(tmin, std::min(ty1, ty2)); tmax = std::min(tmax, std::max(ty1, ty2));
+    float tz1 = (box.min.z - ray.origin.z) * invDir.z, tz2 = (box.max.z - ray.origin.z) * invDir.z;
+    tmin = std::max(tmin, std::min(tz1, tz2)); tmax = std::min(tmax, std::max(tz1, tz2));
     
-    // Add back wall
-    Vector3 wallColor(0.4f, 0.4f, 0.6f);
-    triangles.push_back(Triangle(
-        Vector3(-5, 5, -5), Vector3(5, 5, -5), Vector3(5, -1, -5), wallColor, true));
-    triangles.push_back(Triangle(
-        Vector3(-5, 5, -5), Vector3(5, -1, -5), Vector3(-5, -1, -5), wallColor, true));
-
-    // Add directional light indicator
-    Vector3 lightPos(2, 5, 1);
-    for (int i = 0; i < 3; i++) {
-        Vector3 offset(0.1f, 0.1f, 0.1f);
-        if (i == 1) offset = Vector3(-0.1f, 0.1f, 0.1f);
-        if (i == 2) offset = Vector3(0.1f, -0.1f, 0.1f);
-        triangles.push_back(Triangle(
-            lightPos, 
-            lightPos + Vector3(0.2f, 0, 0) + offset,
-            lightPos + Vector3(0, 0.2f, 0) + offset,
-            Vector3(1, 1, 0.5f), true));
-    }
-
-    std::cerr << "Rendering " << width << "x" << height << " image...\n";
+    if (tmax >= tmin && tmax > 0 && tmin < tMax) return tmin;
+    return FLT_MAX;
+}
+
+struct BVHNode {
+    AABB bounds;
+    uint32_t leftFirst; // Left child index for inner nodes, first index for leaves
+    uint32_t count;     // Triangle count, 0 for inner nodes
     
-    auto start = std::chrono::high_resolution_clock::now();
+    bool isLeaf() const { return count > 0; }
+};
+
+enum class TriangleLayout {
+    Precomputed, // TriangleSoA copy with edges and normals, SIMD leaf kernels
+    Indexed      // Read vertices through the mesh index buffers - least memory
+};
+
+enum class BVHBuilder {
+    Sweep,  // Full SAH sweep over sorted centroids - best trees, slowest build
+    Binned, // SAH evaluated over BVH_BINS centroid bins per axis
+    LBVH    // Morton-code order split at the highest differing bit - fastest build
+};
+
+const char* builderName(BVHBuilder builder) {
+    switch (builder) {
+    case BVHBuilder::Binned: return "binned";
+    case BVHBuilder::LBVH: return "lbvh";
+    default: return "sweep";
+    }
+}
+
+// Shape of a built tree. sahCost is the expected cost of a random ray under the
+// same model the builders optimize, so lower is better.
+struct BVHStats {
+    uint32_t nodeCount = 0;
+    uint32_t leafCount = 0;
+    uint32_t maxDepth = 0;
+    float averageLeafSize = 0;
+    float sahCost = 0;
+};
+
+// What BVH::refit() did. The costs are sahCost as in BVHStats.
+struct BVHRefitStats {
+    float builtSahCost = 0;   // Before the vertices moved
+    float refitSahCost = 0;   // With the moved bounds, before any rebuild
+    float sahCost = 0;        // As left, after the rebuilds
+    uint32_t rebuiltSubtrees = 0;
+    uint32_t rebuiltPrims = 0;
+};
+
+const float BVH_REBUILD_RATIO = 1.5f; // See BVH::refit()
+
+// Node of the compressed 4-wide BVH (see BVH::compress()). The node's box is a
+// float origin plus a power-of-two step per axis, and each child's box is a
+// whole number of steps from the origin, rounded outwards so it still bounds
+// the child. One node is one cache line, where the binary tree spends three
+// 32 byte nodes on the same four children.
+struct alignas(64) CompressedNode {
+    float origin[3];
+    int8_t exponent[3];   // The step along each axis is 2^exponent
+    uint8_t childCount;
+    uint8_t lo[3][4];     // Per axis, per child
+    uint8_t hi[3][4];
+    uint32_t child[4];    // Node index of an inner child, first prim slot of a leaf
+    uint8_t leafCount[4]; // Triangles of a leaf child (plus EXACT_LEAF), 0 for an inner one
+    uint8_t culling;      // Culling of each leaf child, two bits apiece
     
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            Ray ray = computePrimRay(x, y, width, height, cameraPos);
-            image[y * width + x] = trace(ray, triangles);
-        }
-        
-        // Show progress
-        if (y % 20 == 0) {
-            float progress = (y * 100.0f) / height;
-            std::cerr << "Progress: " << progress << "%\r";
-            std::cerr.flush();
-        }
+    float step(int axis) const {
+        uint32_t bits = (uint32_t)(exponent[axis] + 127) << 23;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    AABB childBounds(int k) const {
+        float sx = step(0), sy = step(1), sz = step(2);
+        AABB box;
+        box.min = Vector3(origin[0] + lo[0][k] * sx, origin[1] + lo[1][k] * sy, origin[2] + lo[2][k] * sz);
+        box.max = Vector3(origin[0] + hi[0][k] * sx, origin[1] + hi[1][k] * sy, origin[2] + hi[2][k] * sz);
+        return box;
     }
+    Culling childCulling(int k) const { return (Culling)((culling >> (2 * k)) & 3); }
+    uint32_t triangleCount(int k) const { return leafCount[k] & (EXACT_LEAF - 1); }
     
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-    std::cerr << "\nRendering took " << duration.count() << " ms\n";
+    // Set on leaves too big for 16-bit vertices to stay well inside EPSILON, which
+    // read theirs from the meshes instead
+    static const uint8_t EXACT_LEAF = 0x80;
+};
+static_assert(sizeof(CompressedNode) == 64, "compressed nodes are one cache line");
 
-    // Output PPM
-    std::ofstream file("output.ppm");
-    file << "P3\n" << width << " " << height << "\n255\n";
-    for (auto& color : image) {
-        int r = std::min(255, std::max(0, (int)(255 * color.x)));
-        int g = std::min(255, std::max(0, (int)(255 * color.y)));
-        int b = std::min(255, std::max(0, (int)(255 * color.z)));
-        file << r << " " << g << " " << b << "\n";
-    }
-    file.close();
+// A BVH after compress(): the wide nodes plus, when the vertices are compressed
+// too, 9 16-bit coordinates per prim slot, each relative to its leaf's box. The
+// coordinates are rounded to 1/65535 of the box, so only leaves whose step stays
+// below EPSILON / 2 use them; shadow rays start EPSILON off the surface.
+struct CompressedBVH {
+    std::vector<CompressedNode> nodes;
+    std::vector<uint16_t> vertices;
+    AABB bounds;
+    
+    bool empty() const { return nodes.empty(); }
+    void clear() { nodes.clear(); nodes.shrink_to_fit(); vertices.clear(); vertices.shrink_to_fit(); }
+    size_t memoryBytes() const { return nodes.capacity() * sizeof(CompressedNode) + vertices.capacity() * sizeof(uint16_t); }
+};
 
-    std::cerr << "Rendering complete! Saved output.ppm\n";
-    return 0;
-}
\ No newline at end of file
+// Bounding volume hierarchy over a list of meshes, built with the surface area
+// heuristic. Leaves reference contiguous ranges of prims (and tris for the
+// Precomputed layout), which are stored in leaf order.
+struct BVH {
+    std::vector<BVHNode> nodes;
+    std::vector<PrimRef> prims;
+    TriangleSoA tris;
+    TriangleLayout layout = TriangleLayout::Precomputed;
+    const std::vector<Mesh>* meshes = nullptr;
+    
+    // With a pool, the top of the tree is split on the caller and the subtrees
+    // below it are built in parallel
+    void build(const std::vector<Mesh>& meshes, TriangleLayout layout = TriangleLayout::Precomputed,
+               BVHBuilder builder = BVHBuilder::Sweep, ThreadPool* pool = nullptr);
+    // Points an already filled in nodes/prims/tris at meshes, as build() would leave them
+    void attach(const std::vector<Mesh>& meshes, TriangleLayout layout);
+    // Culling of every leaf's triangles, by node index (inner nodes unused). Set by build() and attach().
+    std::vector<Culling> leafCulling;
+    bool intersect(const Ray& ray, HitRecord& hit) const;
+    bool occluded(const Ray& ray, float tMax) const;
+    size_t memoryBytes() const;
+    BVHStats stats() const;
+    const char* kernelName() const {
+        if (!compressed.vertices.empty()) return "compressed";
+        return layout == TriangleLayout::Precomputed ? leafKernels.name : "indexed";
+    }
+    
+    // Swaps the binary nodes for the compressed 4-wide tree, and with vertices the
+    // precomputed triangles (if any) for 16-bit coordinates too. Traversal decodes
+    // both on the fly, trading some speed per ray for a smaller working set.
+    // refit() needs the binary tree, so build again before it. Returns false and
+    // leaves the tree as it was if a leaf holds more triangles than a node encodes.
+    bool compress(bool vertices);
+    bool isCompressed() const { return !compressed.empty(); }
+    CompressedBVH compressed;
+    AABB bounds() const { return isCompressed() ? compressed.bounds : nodes.empty() ? AABB() : nodes[0].bounds; }
+    
+    // Follows the meshes after their vertices moved in place, topology unchanged.
+    // Every node's bounds are refitted bottom-up, subtrees in parallel on the pool;
+    // then any subtree whose own split now costs more than rebuildRatio times what
+    // it did when built is rebuilt from scratch, in parallel too.
+    BVHRefitStats refit(ThreadPool* pool = nullptr, float rebuildRatio = BVH_REBUILD_RATIO);
+    
+private:
+    std::vector<uint32_t> indices;
+    std::vector<AABB> triBounds;
+    std::vector<Vector3> centroids;
+    std::vector<uint32_t> mortonCodes;
+    std::vector<float> sweepAreas; // Sweep scratch, indexed like indices so concurrent subtrees never overlap
+    uint32_t leafWidth = 1;
+    BVHBuilder builder = BVHBuilder::Sweep;
+    // Per node, the SAH cost of its subtree relative to its own box when it was built.
+    // refit() compares against it to spot the subtrees that motion has degraded.
+    std::vector<float> builtCost;
+    
+    void updateBounds(std::vector<BVHNode>& out, uint32_t nodeIdx) const;
+    bool splitNode(std::vector<BVHNode>& out, uint32_t nodeIdx, ThreadPool* pool);
+    void subdivide(std::vector<BVHNode>& out, uint32_t nodeIdx, uint32_t depth);
+    void buildParallel(ThreadPool& pool);
+    uint32_t splitSweep(const BVHNode& node);
+    uint32_t splitBinned(const BVHNode& node, ThreadPool* pool);
+    uint32_t splitMorton(const BVHNode& node);
+    bool keepLeaf(const BVHNode& node, float bestCost) const;
+    float leafSteps(uint32_t count) const;
+    bool intersectLeaf(const BVHNode& node, const Ray& ray, HitRecord& hit) const;
+    bool occludedLeaf(const BVHNode& node, const Ray& ray, float tMax) const;
+    void finalizeHit(const Ray& ray, HitRecord& hit) const;
+    void classifyLeaves();
+    std::vector<float> subtreeCosts() const;
+    void primRange(uint32_t nodeIdx, uint32_t& first, uint32_t& end) const;
+    void refitNode(uint32_t nodeIdx);
+    void selectRebuilds(uint32_t nodeIdx, const std::vector<float>& cost, float ratio, std::vector<uint32_t>& out) const;
+    void rebuildSubtrees(const std::vector<uint32_t>& roots, ThreadPool* pool);
+    uint32_t compressNode(uint32_t nodeIdx);
+    bool intersectCompressed(const Ray& ray, HitRecord& hit) const;
+    bool occludedCompressed(const Ray& ray, float tMax) const;
+    bool intersectCompressedLeaf(const CompressedNode& node, int k, const Ray& ray, HitRecord& hit) const;
+    bool occludedCompressedLeaf(const CompressedNode& node, int k, const Ray& ray, float tMax) const;
+};
+
+const float SAH_TRAVERSAL_COST = 1.0f;
+const float SAH_INTERSECT_COST = 1.0f;
+const uint32_t BVH_MAX_LEAF_SIZE = 16;
+// Traversal keeps at most one pending node per level on a fixed stack, so the
+// builders make a leaf of any node this deep whatever the split heuristic says
+const uint32_t BVH_STACK_SIZE = 64;
+const uint32_t BVH_MAX_DEPTH = BVH_STACK_SIZE - 1;
+const int BVH_BINS = 16;
+const uint32_t BVH_PARALLEL_MIN_PRIMS = 1 << 14; // Smaller nodes are finished as one task
+
+// SIMD kernels test a whole vector of triangles for the price of one
+float BVH::leafSteps(uint32_t count) const {
+    return (float)((count + leafWidth - 1) / leafWidth);
+}
+
+void BVH::attach(const std::vector<Mesh>& sceneMeshes, TriangleLayout triangleLayout) {
+    compressed.clear();
+    meshes = &sceneMeshes;
+    layout = triangleLayout;
+    leafWidth = layout == TriangleLayout::Precomputed ? leafKernels.width : 1;
+    classifyLeaves();
+    builtCost = subtreeCosts();
+}
+
+// Whole meshes share one sidedness, so nearly every leaf gets a kernel without the per-triangle check
+void BVH::classifyLeaves() {
+    leafCulling.assign(nodes.size(), Culling::PerTriangle);
+    for (size_t n = 0; n < nodes.size(); n++) {
+        const BVHNode& node = nodes[n];
+        if (!node.isLeaf()) continue;
+        uint32_t doubleSided = 0;
+        for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++)
+            doubleSided += (*meshes)[prims[i].mesh].doubleSided;
+        if (doubleSided == node.count) leafCulling[n] = Culling::None;
+        else if (doubleSided == 0) leafCulling[n] = Culling::Back;
+    }
+}
+
+// Spreads the 10-bit value out to every third bit
+inline uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of a point in the unit cube
+inline uint32_t morton3D(float x, float y, float z) {
+    uint32_t ix = (uint32_t)std::min(std::max(x * 1024.0f, 0.0f), 1023.0f);
+    uint32_t iy = (uint32_t)std::min(std::max(y * 1024.0f, 0.0f), 1023.0f);
+    uint32_t iz = (uint32_t)std::min(std::max(z * 1024.0f, 0.0f), 1023.0f);
+    return (expandBits(ix) << 2) | (expandBits(iy) << 1) | expandBits(iz);
+}
+
+void BVH::build(const std::vector<Mesh>& sceneMeshes, TriangleLayout triangleLayout,
+                BVHBuilder treeBuilder, ThreadPool* pool) {
+    nodes.clear();
+    attach(sceneMeshes, triangleLayout);
+    builder = treeBuilder;
+    
+    std::vector<PrimRef> allPrims;
+    for (uint32_t m = 0; m < sceneMeshes.size(); m++) {
+        for (uint32_t t = 0; t < sceneMeshes[m].triangleCount(); t++) allPrims.push_back(PrimRef{m, t});
+    }
+    
+    uint32_t primCount = (uint32_t)allPrims.size();
+    indices.resize(primCount);
+    triBounds.resize(primCount);
+    centroids.resize(primCount);
+    auto forEachPrim = [&](const std::function<void(uint32_t)>& fn) {
+        if (pool && pool->size() > 1 && primCount >= BVH_PARALLEL_MIN_PRIMS) {
+            uint32_t chunks = (uint32_t)pool->size() * 4;
+            pool->parallelFor(chunks, [&](uint32_t c, unsigned) {
+                uint32_t end = (uint32_t)((uint64_t)primCount * (c + 1) / chunks);
+                for (uint32_t i = (uint32_t)((uint64_t)primCount * c / chunks); i < end; i++) fn(i);
+            });
+        } else {
+            for (uint32_t i = 0; i < primCount; i++) fn(i);
+        }
+    };
+    forEachPrim([&](uint32_t i) {
+        const Mesh& mesh = sceneMeshes[allPrims[i].mesh];
+        const Vector3& v0 = mesh.vertex(allPrims[i].triangle, 0);
+        const Vector3& v1 = mesh.vertex(allPrims[i].triangle, 1);
+        const Vector3& v2 = mesh.vertex(allPrims[i].triangle, 2);
+        indices[i] = i;
+        AABB box;
+        box.grow(v0);
+        box.grow(v1);
+        box.grow(v2);
+        triBounds[i] = box;
+        centroids[i] = (v0 + v1 + v2) * (1.0f / 3.0f);
+    });
+    
+    // LBVH splits ranges of the primitives sorted along a Morton curve
+    if (builder == BVHBuilder::LBVH) {
+        AABB centroidBounds;
+        for (uint32_t i = 0; i < primCount; i++) centroidBounds.grow(centroids[i]);
+        Vector3 extent = centroidBounds.max - centroidBounds.min;
+        Vector3 scale(extent.x > 0 ? 1 / extent.x : 0, extent.y > 0 ? 1 / extent.y : 0, extent.z > 0 ? 1 / extent.z : 0);
+        mortonCodes.resize(primCount);
+        forEachPrim([&](uint32_t i) {
+            Vector3 p = centroids[i] - centroidBounds.min;
+            mortonCodes[i] = morton3D(p.x * scale.x, p.y * scale.y, p.z * scale.z);
+        });
+        std::sort(indices.begin(), indices.end(),
+            [&](uint32_t a, uint32_t b) { return mortonCodes[a] < mortonCodes[b]; });
+    }
+    if (builder == BVHBuilder::Sweep) sweepAreas.resize(primCount);
+    
+    if (primCount > 0) {
+        nodes.reserve(primCount * 2 - 1);
+        BVHNode root;
+        root.leftFirst = 0;
+        root.count = primCount;
+        nodes.push_back(root);
+        updateBounds(nodes, 0);
+        if (pool && pool->size() > 1) buildParallel(*pool);
+        else subdivide(nodes, 0, 0);
+        nodes.shrink_to_fit();
+    }
+    
+    prims.resize(primCount);
+    for (uint32_t i = 0; i < primCount; i++) prims[i] = allPrims[indices[i]];
+    if (layout == TriangleLayout::Precomputed) tris.build(sceneMeshes, prims);
+    else tris = TriangleSoA();
+    
+    indices.clear();
+    indices.shrink_to_fit();
+    triBounds.clear();
+    triBounds.shrink_to_fit();
+    centroids.clear();
+    centroids.shrink_to_fit();
+    mortonCodes.clear();
+    mortonCodes.shrink_to_fit();
+    sweepAreas.clear();
+    sweepAreas.shrink_to_fit();
+    classifyLeaves();
+    builtCost = subtreeCosts();
+}
+
+size_t BVH::memoryBytes() const {
+    size_t bytes = nodes.capacity() * sizeof(BVHNode) + prims.capacity() * sizeof(PrimRef) +
+                   leafCulling.capacity() * sizeof(Culling) + builtCost.capacity() * sizeof(float) +
+                   compressed.memoryBytes();
+    if (layout == TriangleLayout::Precomputed) bytes += tris.v0x.capacity() * (12 * sizeof(float) + 1);
+    return bytes;
+}
+
+BVHStats BVH::stats() const {
+    BVHStats result;
+    if (nodes.empty()) return result;
+    result.nodeCount = (uint32_t)nodes.size();
+    
+    float rootArea = std::max(nodes[0].bounds.area(), 1e-8f);
+    std::vector<std::pair<uint32_t, uint32_t>> stack = { { 0, 1 } };
+    uint64_t leafPrims = 0;
+    while (!stack.empty()) {
+        uint32_t nodeIdx = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        const BVHNode& node = nodes[nodeIdx];
+        float relativeArea = node.bounds.area() / rootArea;
+        result.maxDepth = std::max(result.maxDepth, depth);
+        if (node.isLeaf()) {
+            result.leafCount++;
+            leafPrims += node.count;
+            result.sahCost += relativeArea * SAH_INTERSECT_COST * leafSteps(node.count);
+        } else {
+            result.sahCost += relativeArea * SAH_TRAVERSAL_COST;
+            stack.push_back({ node.leftFirst, depth + 1 });
+            stack.push_back({ node.leftFirst + 1, depth + 1 });
+        }
+    }
+    result.averageLeafSize = (float)leafPrims / std::max(1u, result.leafCount);
+    return result;
+}
+
+void BVH::updateBounds(std::vector<BVHNode>& out, uint32_t nodeIdx) const {
+    BVHNode& node = out[nodeIdx];
+    node.bounds = AABB();
+    for (uint32_t i = 0; i < node.count; i++) {
+        node.bounds.grow(triBounds[indices[node.leftFirst + i]]);
+    }
+}
+
+// SAH termination shared by the SAH builders. bestCost is the
+// area-weighted leaf steps of the best split found.
+bool BVH::keepLeaf(const BVHNode& node, float bestCost) const {
+    float splitCost = SAH_TRAVERSAL_COST + SAH_INTERSECT_COST * bestCost / std::max(node.bounds.area(), 1e-8f);
+    float leafCost = SAH_INTERSECT_COST * leafSteps(node.count);
+    return splitCost >= leafCost && node.count <= std::max(BVH_MAX_LEAF_SIZE, leafKernels.width);
+}
+
+// The split* functions reorder indices inside the node's range and return how
+// many go to the left child, or 0 to keep the node as a leaf
+uint32_t BVH::splitSweep(const BVHNode& node) {
+    uint32_t first = node.leftFirst;
+    uint32_t count = node.count;
+    if (count <= 1) return 0;
+    
+    // Full SAH sweep over the centroid-sorted triangles on every axis
+    float* rightArea = &sweepAreas[first];
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    uint32_t bestSplit = 0;
+    
+    for (int axis = 0; axis < 3; axis++) {
+        std::sort(indices.begin() + first, indices.begin() + first + count,
+            [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+        
+        AABB right;
+        for (uint32_t i = count - 1; i > 0; i--) {
+            right.grow(triBounds[indices[first + i]]);
+            rightArea[i] = right.area();
+        }
+        
+        AABB left;
+        for (uint32_t i = 1; i < count; i++) {
+            left.grow(triBounds[indices[first + i - 1]]);
+            float cost = left.area() * leafSteps(i) + rightArea[i] * leafSteps(count - i);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+    
+    if (keepLeaf(node, bestCost)) return 0;
+    
+    if (bestAxis != 2) {
+        std::sort(indices.begin() + first, indices.begin() + first + count,
+            [&](uint32_t a, uint32_t b) { return centroids[a][bestAxis] < centroids[b][bestAxis]; });
+    }
+    return bestSplit;
+}
+
+struct BVHBin {
+    AABB bounds;
+    uint32_t count = 0;
+};
+
+uint32_t BVH::splitBinned(const BVHNode& node, ThreadPool* pool) {
+    uint32_t first = node.leftFirst;
+    uint32_t count = node.count;
+    if (count <= 1) return 0;
+    
+    // Big nodes near the root are binned in chunks on the pool and merged
+    uint32_t chunks = (pool && count >= BVH_PARALLEL_MIN_PRIMS) ? (uint32_t)pool->size() * 4 : 1;
+    auto forEachChunk = [&](auto&& fn) {
+        auto run = [&](uint32_t c, unsigned) {
+            fn(c, first + (uint32_t)((uint64_t)count * c / chunks), first + (uint32_t)((uint64_t)count * (c + 1) / chunks));
+        };
+        if (chunks > 1) pool->parallelFor(chunks, run);
+        else run(0, 0);
+    };
+    
+    // Per-chunk partial results. Only the chunked nodes need the heap.
+    AABB singleBounds;
+    BVHBin singleBins[3 * BVH_BINS];
+    std::vector<AABB> manyBounds(chunks > 1 ? chunks : 0);
+    std::vector<BVHBin> manyBins(chunks > 1 ? chunks * 3 * BVH_BINS : 0);
+    AABB* chunkBounds = chunks > 1 ? manyBounds.data() : &singleBounds;
+    BVHBin* chunkBins = chunks > 1 ? manyBins.data() : singleBins;
+    
+    forEachChunk([&](uint32_t c, uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) chunkBounds[c].grow(centroids[indices[i]]);
+    });
+    AABB centroidBounds;
+    for (uint32_t c = 0; c < chunks; c++) centroidBounds.grow(chunkBounds[c]);
+    
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        scale[axis] = extent > 0 ? BVH_BINS / extent : 0;
+    }
+    auto binOf = [&](const Vector3& c, int axis) {
+        return std::min(BVH_BINS - 1, (int)((c[axis] - centroidBounds.min[axis]) * scale[axis]));
+    };
+    
+    forEachChunk([&](uint32_t c, uint32_t begin, uint32_t end) {
+        BVHBin* bins = &chunkBins[c * 3 * BVH_BINS];
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t prim = indices[i];
+            for (int axis = 0; axis < 3; axis++) {
+                BVHBin& bin = bins[axis * BVH_BINS + binOf(centroids[prim], axis)];
+                bin.bounds.grow(triBounds[prim]);
+                bin.count++;
+            }
+        }
+    });
+    BVHBin bins[3][BVH_BINS];
+    for (uint32_t c = 0; c < chunks; c++) {
+        for (int i = 0; i < 3 * BVH_BINS; i++) {
+            const BVHBin& src = chunkBins[c * 3 * BVH_BINS + i];
+            bins[i / BVH_BINS][i % BVH_BINS].bounds.grow(src.bounds);
+            bins[i / BVH_BINS][i % BVH_BINS].count += src.count;
+        }
+    }
+    
+    // Evaluate the BVH_BINS - 1 planes between bins
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestPlane = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0) continue;
+        float rightArea[BVH_BINS];
+        uint32_t rightCount[BVH_BINS];
+        AABB right;
+        uint32_t rightSum = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+            right.grow(bins[axis][b].bounds);
+            rightSum += bins[axis][b].count;
+            rightArea[b] = right.area();
+            rightCount[b] = rightSum;
+        }
+        AABB left;
+        uint32_t leftSum = 0;
+        for (int b = 1; b < BVH_BINS; b++) {
+            left.grow(bins[axis][b - 1].bounds);
+            leftSum += bins[axis][b - 1].count;
+            if (leftSum == 0 || rightCount[b] == 0) continue;
+            float cost = left.area() * leafSteps(leftSum) + rightArea[b] * leafSteps(rightCount[b]);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPlane = b;
+            }
+        }
+    }
+    
+    // All centroids in one bin - split by count if the node is too big for a leaf
+    if (bestAxis < 0) return count > std::max(BVH_MAX_LEAF_SIZE, leafKernels.width) ? count / 2 : 0;
+    if (keepLeaf(node, bestCost)) return 0;
+    
+    auto mid = std::partition(indices.begin() + first, indices.begin() + first + count,
+        [&](uint32_t prim) { return binOf(centroids[prim], bestAxis) < bestPlane; });
+    return (uint32_t)(mid - (indices.begin() + first));
+}
+
+// Ranges are already in Morton order, so a split is a search for the first
+// code with the highest bit that differs across the range
+uint32_t BVH::splitMorton(const BVHNode& node) {
+    uint32_t first = node.leftFirst;
+    uint32_t count = node.count;
+    if (count <= std::max(4u, leafWidth)) return 0;
+    
+    uint32_t firstCode = mortonCodes[indices[first]];
+    uint32_t lastCode = mortonCodes[indices[first + count - 1]];
+    if (firstCode == lastCode) return count / 2;
+    
+    uint32_t bit = 31;
+    while (!(((firstCode ^ lastCode) >> bit) & 1)) bit--;
+    auto mid = std::partition_point(indices.begin() + first, indices.begin() + first + count,
+        [&](uint32_t prim) { return !((mortonCodes[prim] >> bit) & 1); });
+    return (uint32_t)(mid - (indices.begin() + first));
+}
+
+// Splits one node with the selected builder, appending both children to out
+bool BVH::splitNode(std::vector<BVHNode>& out, uint32_t nodeIdx, ThreadPool* pool) {
+    const BVHNode node = out[nodeIdx];
+    uint32_t split = 0;
+    switch (builder) {
+    case BVHBuilder::Sweep: split = splitSweep(node); break;
+    case BVHBuilder::Binned: split = splitBinned(node, pool); break;
+    case BVHBuilder::LBVH: split = splitMorton(node); break;
+    }
+    if (split == 0 || split >= node.count) return false;
+    
+    uint32_t leftIdx = (uint32_t)out.size();
+    BVHNode left, right;
+    left.leftFirst = node.leftFirst;
+    left.count = split;
+    right.leftFirst = node.leftFirst + split;
+    right.count = node.count - split;
+    out.push_back(left);
+    out.push_back(right);
+    
+    out[nodeIdx].leftFirst = leftIdx;
+    out[nodeIdx].count = 0;
+    
+    updateBounds(out, leftIdx);
+    updateBounds(out, leftIdx + 1);
+    return true;
+}
+
+void BVH::subdivide(std::vector<BVHNode>& out, uint32_t nodeIdx, uint32_t depth) {
+    if (depth >= BVH_MAX_DEPTH || !splitNode(out, nodeIdx, nullptr)) return;
+    uint32_t leftIdx = out[nodeIdx].leftFirst;
+    subdivide(out, leftIdx, depth + 1);
+    subdivide(out, leftIdx + 1, depth + 1);
+}
+
+// Splits the top of the tree breadth first on the caller until there is enough
+// independent work, then builds every subtree below that as one pool task. Each
+// task fills its own node array, which is appended to nodes afterwards.
+void BVH::buildParallel(ThreadPool& pool) {
+    const size_t wantedTasks = pool.size() * 4;
+    std::vector<uint32_t> frontier = { 0 }, tasks, taskDepths;
+    uint32_t depth = 0;
+    while (!frontier.empty() && frontier.size() + tasks.size() < wantedTasks) {
+        std::vector<uint32_t> next;
+        for (uint32_t nodeIdx : frontier) {
+            if (nodes[nodeIdx].count < BVH_PARALLEL_MIN_PRIMS) {
+                tasks.push_back(nodeIdx);
+                taskDepths.push_back(depth);
+            } else if (depth < BVH_MAX_DEPTH && splitNode(nodes, nodeIdx, &pool)) {
+                next.push_back(nodes[nodeIdx].leftFirst);
+                next.push_back(nodes[nodeIdx].leftFirst + 1);
+            }
+        }
+        frontier.swap(next);
+        depth++;
+    }
+    tasks.insert(tasks.end(), frontier.begin(), frontier.end());
+    taskDepths.resize(tasks.size(), depth);
+    
+    // Tasks own disjoint ranges of indices, so they only share read-only data
+    std::vector<std::vector<BVHNode>> subtrees(tasks.size());
+    pool.parallelFor((uint32_t)tasks.size(), [&](uint32_t i, unsigned) {
+        subtrees[i].push_back(nodes[tasks[i]]);
+        subdivide(subtrees[i], 0, taskDepths[i]);
+    });
+    
+    for (size_t i = 0; i < tasks.size(); i++) {
+        // A subtree's node j > 0 lands at base + j
+        uint32_t base = (uint32_t)nodes.size() - 1;
+        const std::vector<BVHNode>& subtree = subtrees[i];
+        for (size_t j = 0; j < subtree.size(); j++) {
+            BVHNode node = subtree[j];
+            if (!node.isLeaf()) node.leftFirst += base;
+            if (j == 0) nodes[tasks[i]] = node;
+            else nodes.push_back(node);
+        }
+    }
+}
+
+// Expected cost of a ray that hits each node's box, as in BVHStats but relative
+// to the node rather than the root. Children always come after their parent.
+std::vector<float> BVH::subtreeCosts() const {
+    std::vector<float> cost(nodes.size());
+    for (size_t n = nodes.size(); n-- > 0; ) {
+        const BVHNode& node = nodes[n];
+        if (node.isLeaf()) {
+            cost[n] = SAH_INTERSECT_COST * leafSteps(node.count);
+            continue;
+        }
+        const BVHNode& left = nodes[node.leftFirst];
+        const BVHNode& right = nodes[node.leftFirst + 1];
+        cost[n] = SAH_TRAVERSAL_COST + (left.bounds.area() * cost[node.leftFirst] +
+                                        right.bounds.area() * cost[node.leftFirst + 1]) /
+                                       std::max(node.bounds.area(), 1e-8f);
+    }
+    return cost;
+}
+
+// A subtree covers the prims from its leftmost leaf to the end of its rightmost
+void BVH::primRange(uint32_t nodeIdx, uint32_t& first, uint32_t& end) const {
+    uint32_t leftmost = nodeIdx, rightmost = nodeIdx;
+    while (!nodes[leftmost].isLeaf()) leftmost = nodes[leftmost].leftFirst;
+    while (!nodes[rightmost].isLeaf()) rightmost = nodes[rightmost].leftFirst + 1;
+    first = nodes[leftmost].leftFirst;
+    end = nodes[rightmost].leftFirst + nodes[rightmost].count;
+}
+
+// Children first, leaves straight from the mesh vertices
+void BVH::refitNode(uint32_t nodeIdx) {
+    BVHNode& node = nodes[nodeIdx];
+    node.bounds = AABB();
+    if (node.isLeaf()) {
+        for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+            const Mesh& mesh = (*meshes)[prims[i].mesh];
+            for (int corner = 0; corner < 3; corner++) node.bounds.grow(mesh.vertex(prims[i].triangle, corner));
+            if (layout == TriangleLayout::Precomputed) tris.set(i, mesh, prims[i].triangle);
+        }
+        return;
+    }
+    refitNode(node.leftFirst);
+    refitNode(node.leftFirst + 1);
+    node.bounds.grow(nodes[node.leftFirst].bounds);
+    node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+}
+
+// A degraded node is rebuilt when its own split is to blame, judged with its
+// children at their built cost. Otherwise the blame lies lower down, and only
+// the degraded children are looked at.
+void BVH::selectRebuilds(uint32_t nodeIdx, const std::vector<float>& cost, float ratio,
+                         std::vector<uint32_t>& out) const {
+    const BVHNode& node = nodes[nodeIdx];
+    if (node.isLeaf() || cost[nodeIdx] <= ratio * builtCost[nodeIdx]) return;
+    uint32_t left = node.leftFirst, right = node.leftFirst + 1;
+    float splitCost = SAH_TRAVERSAL_COST + (nodes[left].bounds.area() * builtCost[left] +
+                                            nodes[right].bounds.area() * builtCost[right]) /
+                                           std::max(node.bounds.area(), 1e-8f);
+    if (splitCost > ratio * builtCost[nodeIdx]) {
+        out.push_back(nodeIdx);
+        return;
+    }
+    selectRebuilds(left, cost, ratio, out);
+    selectRebuilds(right, cost, ratio, out);
+}
+
+// Runs the builder again over each root's range of prims, one pool task per
+// root. The new subtrees replace the old ones in place of their roots, and the
+// node array is then compacted breadth first, dropping the old subtrees.
+void BVH::rebuildSubtrees(const std::vector<uint32_t>& roots, ThreadPool* pool) {
+    const uint32_t primCount = (uint32_t)prims.size();
+    indices.resize(primCount);
+    triBounds.resize(primCount);
+    centroids.resize(primCount);
+    if (builder == BVHBuilder::Sweep) sweepAreas.resize(primCount);
+    if (builder == BVHBuilder::LBVH) mortonCodes.resize(primCount);
+    
+    // The new subtrees continue at their roots' depth, under the same cap
+    std::vector<uint32_t> depth(nodes.size(), 0);
+    for (size_t n = 0; n < nodes.size(); n++) {
+        if (!nodes[n].isLeaf()) depth[nodes[n].leftFirst] = depth[nodes[n].leftFirst + 1] = depth[n] + 1;
+    }
+    
+    std::vector<std::vector<BVHNode>> subtrees(roots.size());
+    auto rebuild = [&](uint32_t r, unsigned) {
+        uint32_t first, end;
+        primRange(roots[r], first, end);
+        
+        AABB centroidBounds;
+        for (uint32_t i = first; i < end; i++) {
+            const Mesh& mesh = (*meshes)[prims[i].mesh];
+            AABB box;
+            for (int corner = 0; corner < 3; corner++) box.grow(mesh.vertex(prims[i].triangle, corner));
+            indices[i] = i;
+            triBounds[i] = box;
+            centroids[i] = (mesh.vertex(prims[i].triangle, 0) + mesh.vertex(prims[i].triangle, 1) +
+                            mesh.vertex(prims[i].triangle, 2)) * (1.0f / 3.0f);
+            centroidBounds.grow(centroids[i]);
+        }
+        if (builder == BVHBuilder::LBVH) {
+            Vector3 extent = centroidBounds.max - centroidBounds.min;
+            Vector3 scale(extent.x > 0 ? 1 / extent.x : 0, extent.y > 0 ? 1 / extent.y : 0, extent.z > 0 ? 1 / extent.z : 0);
+            for (uint32_t i = first; i < end; i++) {
+                Vector3 p = centroids[i] - centroidBounds.min;
+                mortonCodes[i] = morton3D(p.x * scale.x, p.y * scale.y, p.z * scale.z);
+            }
+            std::sort(indices.begin() + first, indices.begin() + end,
+                [&](uint32_t a, uint32_t b) { return mortonCodes[a] < mortonCodes[b]; });
+        }
+        
+        BVHNode root;
+        root.leftFirst = first;
+        root.count = end - first;
+        subtrees[r].push_back(root);
+        updateBounds(subtrees[r], 0);
+        subdivide(subtrees[r], 0, depth[roots[r]]);
+        
+        // Leaf order of the range follows the new indices
+        std::vector<PrimRef> rangePrims(prims.begin() + first, prims.begin() + end);
+        for (uint32_t i = first; i < end; i++) {
+            prims[i] = rangePrims[indices[i] - first];
+            if (layout == TriangleLayout::Precomputed) tris.set(i, (*meshes)[prims[i].mesh], prims[i].triangle);
+        }
+    };
+    if (pool && roots.size() > 1) pool->parallelFor((uint32_t)roots.size(), rebuild);
+    else for (uint32_t r = 0; r < roots.size(); r++) rebuild(r, 0);
+    
+    // Nodes of the new subtrees take fresh built costs, the rest keep theirs
+    const size_t oldCount = nodes.size();
+    for (size_t r = 0; r < roots.size(); r++) {
+        uint32_t base = (uint32_t)nodes.size() - 1;
+        for (size_t j = 0; j < subtrees[r].size(); j++) {
+            BVHNode node = subtrees[r][j];
+            if (!node.isLeaf()) node.leftFirst += base;
+            if (j == 0) nodes[roots[r]] = node;
+            else nodes.push_back(node);
+        }
+    }
+    std::vector<float> cost = subtreeCosts();
+    builtCost.resize(nodes.size());
+    for (uint32_t root : roots) builtCost[root] = cost[root];
+    for (size_t n = oldCount; n < nodes.size(); n++) builtCost[n] = cost[n];
+    
+    std::vector<BVHNode> compact = { nodes[0] };
+    std::vector<float> compactCost = { builtCost[0] };
+    compact.reserve(nodes.size());
+    for (size_t n = 0; n < compact.size(); n++) {
+        if (compact[n].isLeaf()) continue;
+        uint32_t left = compact[n].leftFirst;
+        compact[n].leftFirst = (uint32_t)compact.size();
+        for (uint32_t child : { left, left + 1 }) {
+            compact.push_back(nodes[child]);
+            compactCost.push_back(builtCost[child]);
+        }
+    }
+    nodes.swap(compact);
+    builtCost.swap(compactCost);
+    
+    indices.clear();
+    triBounds.clear();
+    centroids.clear();
+    sweepAreas.clear();
+    mortonCodes.clear();
+    classifyLeaves();
+}
+
+BVHRefitStats BVH::refit(ThreadPool* pool, float rebuildRatio) {
+    BVHRefitStats result;
+    if (nodes.empty()) return result;
+    result.builtSahCost = builtCost[0];
+    
+    // The top of the tree is split breadth first until there are enough subtrees
+    // to go around the pool, the same way buildParallel() hands out work. Those
+    // are refitted as tasks and the nodes above them on the caller.
+    const size_t wantedTasks = pool && pool->size() > 1 ? pool->size() * 4 : 1;
+    std::vector<uint32_t> top, subtrees = { 0 };
+    while (subtrees.size() < wantedTasks) {
+        std::vector<uint32_t> next;
+        for (uint32_t nodeIdx : subtrees) {
+            if (nodes[nodeIdx].isLeaf()) {
+                next.push_back(nodeIdx);
+                continue;
+            }
+            top.push_back(nodeIdx);
+            next.push_back(nodes[nodeIdx].leftFirst);
+            next.push_back(nodes[nodeIdx].leftFirst + 1);
+        }
+        if (next.size() == subtrees.size()) break;
+        subtrees.swap(next);
+    }
+    if (subtrees.size() > 1) pool->parallelFor((uint32_t)subtrees.size(), [&](uint32_t i, unsigned) { refitNode(subtrees[i]); });
+    else refitNode(subtrees[0]);
+    // Breadth first order backwards puts children before their parents
+    for (size_t i = top.size(); i-- > 0; ) {
+        BVHNode& node = nodes[top[i]];
+        node.bounds = AABB();
+        node.bounds.grow(nodes[node.leftFirst].bounds);
+        node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+    }
+    
+    std::vector<float> cost = subtreeCosts();
+    result.refitSahCost = result.sahCost = cost[0];
+    std::vector<uint32_t> roots;
+    selectRebuilds(0, cost, rebuildRatio, roots);
+    if (roots.empty()) return result;
+    
+    for (uint32_t root : roots) {
+        uint32_t first, end;
+        primRange(root, first, end);
+        result.rebuiltPrims += end - first;
+    }
+    result.rebuiltSubtrees = (uint32_t)roots.size();
+    rebuildSubtrees(roots, pool);
+    result.sahCost = subtreeCosts()[0];
+    return result;
+}
+
+// Collapses the binary subtree at nodeIdx into wide nodes, depth first. Up to
+// four children are gathered by opening the largest inner child at a time.
+uint32_t BVH::compressNode(uint32_t nodeIdx) {
+    uint32_t children[4] = { nodeIdx };
+    int count = 1;
+    if (!nodes[nodeIdx].isLeaf()) {
+        children[0] = nodes[nodeIdx].leftFirst;
+        children[1] = nodes[nodeIdx].leftFirst + 1;
+        count = 2;
+    }
+    while (count < 4) {
+        int largest = -1;
+        for (int k = 0; k < count; k++) {
+            if (!nodes[children[k]].isLeaf() &&
+                (largest < 0 || nodes[children[k]].bounds.area() > nodes[children[largest]].bounds.area()))
+                largest = k;
+        }
+        if (largest < 0) break;
+        uint32_t opened = children[largest];
+        children[largest] = nodes[opened].leftFirst;
+        children[count++] = nodes[opened].leftFirst + 1;
+    }
+    
+    CompressedNode wide = {};
+    wide.childCount = (uint8_t)count;
+    const AABB& box = nodes[nodeIdx].bounds;
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = box.min[axis], extent = box.max[axis] - lo;
+        wide.origin[axis] = lo;
+        int exponent = -126;
+        if (extent > 0) std::frexp(extent / 255.0f, &exponent);
+        // Both ends are rounded outwards; a step too coarse for the far end to reach the box moves up one
+        for (exponent = std::min(std::max(exponent, -126), 127); ; exponent++) {
+            wide.exponent[axis] = (int8_t)exponent;
+            float step = wide.step(axis);
+            bool fits = true;
+            for (int k = 0; k < count; k++) {
+                const AABB& childBox = nodes[children[k]].bounds;
+                int qlo = std::min(255, std::max(0, (int)std::floor((childBox.min[axis] - lo) / step)));
+                int qhi = std::min(255, std::max(0, (int)std::ceil((childBox.max[axis] - lo) / step)));
+                while (qlo > 0 && lo + qlo * step > childBox.min[axis]) qlo--;
+                while (qhi < 255 && lo + qhi * step < childBox.max[axis]) qhi++;
+                if (lo + qhi * step < childBox.max[axis]) fits = false;
+                wide.lo[axis][k] = (uint8_t)qlo;
+                wide.hi[axis][k] = (uint8_t)qhi;
+            }
+            if (fits || exponent >= 127) break;
+        }
+    }
+    
+    uint32_t wideIdx = (uint32_t)compressed.nodes.size();
+    compressed.nodes.emplace_back();
+    for (int k = 0; k < count; k++) {
+        const BVHNode& child = nodes[children[k]];
+        if (child.isLeaf()) {
+            wide.child[k] = child.leftFirst;
+            wide.leafCount[k] = (uint8_t)child.count;
+            wide.culling |= (uint8_t)((int)leafCulling[children[k]] << (2 * k));
+        } else {
+            wide.child[k] = compressNode(children[k]);
+        }
+    }
+    compressed.nodes[wideIdx] = wide;
+    return wideIdx;
+}
+
+bool BVH::compress(bool compressVertices) {
+    if (isCompressed() || nodes.empty()) return false;
+    for (const BVHNode& node : nodes) {
+        if (node.count >= CompressedNode::EXACT_LEAF) return false;
+    }
+    compressed.bounds = nodes[0].bounds;
+    compressed.nodes.reserve(nodes.size() / 2 + 1);
+    compressNode(0);
+    compressed.nodes.shrink_to_fit();
+    
+    // Vertices are stored as 16-bit fractions of their leaf's box as the parent encodes it
+    if (compressVertices) {
+        compressed.vertices.resize(prims.size() * 9);
+        for (CompressedNode& node : compressed.nodes) {
+            for (int k = 0; k < node.childCount; k++) {
+                if (node.leafCount[k] == 0) continue;
+                AABB box = node.childBounds(k);
+                Vector3 extent = box.max - box.min;
+                if (std::max(extent.x, std::max(extent.y, extent.z)) / 65535 > EPSILON / 2) {
+                    node.leafCount[k] |= CompressedNode::EXACT_LEAF;
+                    continue;
+                }
+                Vector3 scale(extent.x > 0 ? 65535 / extent.x : 0, extent.y > 0 ? 65535 / extent.y : 0,
+                              extent.z > 0 ? 65535 / extent.z : 0);
+                for (uint32_t i = node.child[k]; i < node.child[k] + node.triangleCount(k); i++) {
+                    const Mesh& mesh = (*meshes)[prims[i].mesh];
+                    uint16_t* q = &compressed.vertices[(size_t)i * 9];
+                    for (int corner = 0; corner < 3; corner++) {
+                        Vector3 p = mesh.vertex(prims[i].triangle, corner) - box.min;
+                        *q++ = (uint16_t)std::min(65535.0f, std::max(0.0f, std::round(p.x * scale.x)));
+                        *q++ = (uint16_t)std::min(65535.0f, std::max(0.0f, std::round(p.y * scale.y)));
+                        *q++ = (uint16_t)std::min(65535.0f, std::max(0.0f, std::round(p.z * scale.z)));
+                    }
+                }
+            }
+        }
+        tris = TriangleSoA();
+    }
+    nodes.clear();
+    nodes.shrink_to_fit();
+    leafCulling.clear();
+    leafCulling.shrink_to_fit();
+    builtCost.clear();
+    builtCost.shrink_to_fit();
+    return true;
+}
+
+// Triangle corner of slot i decoded against its leaf's box
+struct CompressedLeafFrame {
+    Vector3 origin, scale;
+    
+    CompressedLeafFrame(const CompressedNode& node, int k) {
+        AABB box = node.childBounds(k);
+        origin = box.min;
+        scale = (box.max - box.min) * (1.0f / 65535);
+    }
+    Vector3 corner(const uint16_t* q) const {
+        return Vector3(origin.x + q[0] * scale.x, origin.y + q[1] * scale.y, origin.z + q[2] * scale.z);
+    }
+};
+
+template <Culling C>
+bool intersectCompressedTriangles(const CompressedLeafFrame& frame, const uint16_t* vertices, const BVH& bvh,
+                                  uint32_t first, uint32_t count, const Ray& ray, HitRecord& hit) {
+    bool found = false;
+    for (uint32_t i = first; i < first + count; i++) {
+        const uint16_t* q = vertices + (size_t)i * 9;
+        Vector3 v0 = frame.corner(q);
+        bool doubleSided = C == Culling::PerTriangle && (*bvh.meshes)[bvh.prims[i].mesh].doubleSided;
+        float t, u, v;
+        if (mollerTrumbore<C>(v0, frame.corner(q + 3) - v0, frame.corner(q + 6) - v0, doubleSided,
+                              ray, hit.distance, t, u, v)) {
+            hit.distance = t;
+            hit.u = u;
+            hit.v = v;
+            hit.primitive = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+template <Culling C>
+bool occludedCompressedTriangles(const CompressedLeafFrame& frame, const uint16_t* vertices, const BVH& bvh,
+                                 uint32_t first, uint32_t count, const Ray& ray, float tMax) {
+    for (uint32_t i = first; i < first + count; i++) {
+        const uint16_t* q = vertices + (size_t)i * 9;
+        Vector3 v0 = frame.corner(q);
+        bool doubleSided = C == Culling::PerTriangle && (*bvh.meshes)[bvh.prims[i].mesh].doubleSided;
+        float t, u, v;
+        if (mollerTrumbore<C>(v0, frame.corner(q + 3) - v0, frame.corner(q + 6) - v0, doubleSided, ray, tMax, t, u, v))
+            return true;
+    }
+    return false;
+}
+
+// Leaf child k of node, through whichever triangle storage the tree kept
+bool BVH::intersectCompressedLeaf(const CompressedNode& node, int k, const Ray& ray, HitRecord& hit) const {
+    const uint32_t first = node.child[k], count = node.triangleCount(k);
+    const Culling culling = node.childCulling(k);
+    RT_STAT_ADD(triangleTests, count);
+    const bool exact = node.leafCount[k] & CompressedNode::EXACT_LEAF;
+    if (!compressed.vertices.empty() && !exact) {
+        CompressedLeafFrame frame(node, k);
+        const uint16_t* q = compressed.vertices.data();
+        switch (culling) {
+        case Culling::None: return intersectCompressedTriangles<Culling::None>(frame, q, *this, first, count, ray, hit);
+        case Culling::Back: return intersectCompressedTriangles<Culling::Back>(frame, q, *this, first, count, ray, hit);
+        default: return intersectCompressedTriangles<Culling::PerTriangle>(frame, q, *this, first, count, ray, hit);
+        }
+    }
+    if (layout == TriangleLayout::Precomputed && !exact) return leafKernels.intersect[(int)culling](tris, first, count, ray, hit);
+    bool found = false;
+    for (uint32_t i = first; i < first + count; i++) {
+        if (intersectTriangle((*meshes)[prims[i].mesh], prims[i].triangle, i, ray, hit)) found = true;
+    }
+    return found;
+}
+
+bool BVH::occludedCompressedLeaf(const CompressedNode& node, int k, const Ray& ray, float tMax) const {
+    const uint32_t first = node.child[k], count = node.triangleCount(k);
+    const Culling culling = node.childCulling(k);
+    RT_STAT_ADD(triangleTests, count);
+    const bool exact = node.leafCount[k] & CompressedNode::EXACT_LEAF;
+    if (!compressed.vertices.empty() && !exact) {
+        CompressedLeafFrame frame(node, k);
+        const uint16_t* q = compressed.vertices.data();
+        switch (culling) {
+        case Culling::None: return occludedCompressedTriangles<Culling::None>(frame, q, *this, first, count, ray, tMax);
+        case Culling::Back: return occludedCompressedTriangles<Culling::Back>(frame, q, *this, first, count, ray, tMax);
+        default: return occludedCompressedTriangles<Culling::PerTriangle>(frame, q, *this, first, count, ray, tMax);
+        }
+    }
+    if (layout == TriangleLayout::Precomputed && !exact) return leafKernels.occluded[(int)culling](tris, first, count, ray, tMax);
+    for (uint32_t i = first; i < first + count; i++) {
+        if (occludesTriangle((*meshes)[prims[i].mesh], prims[i].triangle, ray, tMax)) return true;
+    }
+    return false;
+}
+
+// Children a compressed node's ray test found, nearest last so they pop first.
+// A leaf child is entered as its parent with the child's slot. Wide nodes are
+// never deeper than the binary tree, so 4 entries per level fit the stacks.
+const uint32_t COMPRESSED_STACK_SIZE = 4 * BVH_STACK_SIZE;
+struct CompressedStackEntry {
+    uint32_t node;
+    int32_t leaf; // Child slot of a leaf, -1 for a node
+    float t;
+};
+
+bool BVH::intersectCompressed(const Ray& ray, HitRecord& hit) const {
+    const CompressedNode* nodeData = compressed.nodes.data();
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tRoot = intersectAABB(compressed.bounds, ray, invDir, hit.distance);
+    if (tRoot == FLT_MAX) return false;
+    
+    CompressedStackEntry stack[COMPRESSED_STACK_SIZE];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = { 0, -1, tRoot };
+    bool found = false;
+    while (stackSize > 0) {
+        CompressedStackEntry entry = stack[--stackSize];
+        if (entry.t >= hit.distance) continue; // A closer hit turned up since it was pushed
+        const CompressedNode& node = nodeData[entry.node];
+        if (entry.leaf >= 0) {
+            if (intersectCompressedLeaf(node, entry.leaf, ray, hit)) found = true;
+            continue;
+        }
+        RT_STAT_ADD(nodeVisits, 1);
+        
+        // Children hit, sorted far to near by insertion
+        CompressedStackEntry hits[4];
+        int hitCount = 0;
+        for (int k = 0; k < node.childCount; k++) {
+            float t = intersectAABB(node.childBounds(k), ray, invDir, hit.distance);
+            if (t == FLT_MAX) continue;
+            CompressedStackEntry child = node.leafCount[k] ? CompressedStackEntry{ entry.node, k, t }
+                                                          : CompressedStackEntry{ node.child[k], -1, t };
+            int j = hitCount++;
+            for (; j > 0 && hits[j - 1].t < t; j--) hits[j] = hits[j - 1];
+            hits[j] = child;
+        }
+        for (int j = 0; j < hitCount; j++) stack[stackSize++] = hits[j];
+    }
+    
+    if (found) finalizeHit(ray, hit);
+    return found;
+}
+
+bool BVH::occludedCompressed(const Ray& ray, float tMax) const {
+    const CompressedNode* nodeData = compressed.nodes.data();
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    if (intersectAABB(compressed.bounds, ray, invDir, tMax) == FLT_MAX) return false;
+    
+    uint32_t stack[COMPRESSED_STACK_SIZE];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const CompressedNode& node = nodeData[stack[--stackSize]];
+        RT_STAT_ADD(nodeVisits, 1);
+        for (int k = 0; k < node.childCount; k++) {
+            if (intersectAABB(node.childBounds(k), ray, invDir, tMax) == FLT_MAX) continue;
+            if (!node.leafCount[k]) stack[stackSize++] = node.child[k];
+            else if (occludedCompressedLeaf(node, k, ray, tMax)) return true;
+        }
+    }
+    return false;
+}
+
+bool BVH::intersectLeaf(const BVHNode& node, const Ray& ray, HitRecord& hit) const {
+    if (layout == TriangleLayout::Precomputed)
+        return leafKernels.intersect[(int)leafCulling[&node - nodes.data()]](tris, node.leftFirst, node.count, ray, hit);
+    
+    bool found = false;
+    for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        if (intersectTriangle((*meshes)[prims[i].mesh], prims[i].triangle, i, ray, hit)) found = true;
+    }
+    return found;
+}
+
+bool BVH::occludedLeaf(const BVHNode& node, const Ray& ray, float tMax) const {
+    if (layout == TriangleLayout::Precomputed)
+        return leafKernels.occluded[(int)leafCulling[&node - nodes.data()]](tris, node.leftFirst, node.count, ray, tMax);
+    
+    for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        if (occludesTriangle((*meshes)[prims[i].mesh], prims[i].triangle, ray, tMax)) return true;
+    }
+    return false;
+}
+
+// Fills in position, normal and material for the closest hit
+void BVH::finalizeHit(const Ray& ray, HitRecord& hit) const {
+    const PrimRef& prim = prims[hit.primitive];
+    const Mesh& mesh = (*meshes)[prim.mesh];
+    hit.position = ray.pointAt(hit.distance);
+    
+    if (layout == TriangleLayout::Precomputed && tris.size() > 0) {
+        hit.normal = tris.normal(hit.primitive);
+    } else {
+        const Vector3& v0 = mesh.vertex(prim.triangle, 0);
+        hit.normal = normalize(cross(mesh.vertex(prim.triangle, 1) - v0, mesh.vertex(prim.triangle, 2) - v0));
+    }
+    
+    // Flip normal for backfaces if double-sided
+    if (mesh.doubleSided && dot(hit.normal, ray.direction) > 0) {
+        hit.normal = -hit.normal;
+    }
+    hit.material = mesh.materialOf(prim.triangle);
+}
+
+bool BVH::intersect(const Ray& ray, HitRecord& hit) const {
+    if (isCompressed()) return intersectCompressed(ray, hit);
+    if (nodes.empty()) return false;
+    
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    if (intersectAABB(nodes[0].bounds, ray, invDir, hit.distance) == FLT_MAX) return false;
+    
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stackSize = 0;
+    uint32_t nodeIdx = 0;
+    bool found = false;
+    
+    while (true) {
+        const BVHNode& node = nodes[nodeIdx];
+        RT_STAT_ADD(nodeVisits, 1);
+        if (node.isLeaf()) {
+            RT_STAT_ADD(triangleTests, node.count);
+            if (intersectLeaf(node, ray, hit))
+                found = true;
+            if (stackSize == 0) break;
+            nodeIdx = stack[--stackSize];
+            continue;
+        }
+        
+        // Visit the nearer child first, push the farther one
+        uint32_t nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+        float tNear = intersectAABB(nodes[nearChild].bounds, ray, invDir, hit.distance);
+        float tFar = intersectAABB(nodes[farChild].bounds, ray, invDir, hit.distance);
+        if (tFar < tNear) {
+            std::swap(nearChild, farChild);
+            std::swap(tNear, tFar);
+        }
+        
+        if (tNear == FLT_MAX) {
+            if (stackSize == 0) break;
+            nodeIdx = stack[--stackSize];
+        } else {
+            nodeIdx = nearChild;
+            if (tFar != FLT_MAX) stack[stackSize++] = farChild;
+        }
+    }
+    
+    if (found) finalizeHit(ray, hit);
+    return found;
+}
+
+// Any-hit query for shadow rays - no child ordering, returns at the first blocker
+bool BVH::occluded(const Ray& ray, float tMax) const {
+    if (isCompressed()) return occludedCompressed(ray, tMax);
+    if (nodes.empty()) return false;
+    
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = 0;
+    
+    while (stackSize > 0) {
+        const BVHNode& node = nodes[stack[--stackSize]];
+        RT_STAT_ADD(nodeVisits, 1);
+        if (intersectAABB(node.bounds, ray, invDir, tMax) == FLT_MAX) continue;
+        
+        if (node.isLeaf()) {
+            RT_STAT_ADD(triangleTests, node.count);
+            if (occludedLeaf(node, ray, tMax))
+                return true;
+        } else {
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst;
+        }
+    }
+    
+    return false;
+}
+
+// A point light, or a spherical area light when radius is above 0. color scales
+// the diffuse and specular terms; there is no falloff with distance.
+struct Light {
+    Vector3 position;
+    Vector3 color = Vector3(1, 1, 1);
+    float radius = 0.0f;
+};
+
+const int MAX_LIGHT_SAMPLES = 8;
+
+// Everything shadeHit() reads besides the hit itself. Changing these, or the
+// material colors, leaves the primary hits valid (see GBuffer).
+struct ShadingParams {
+    std::vector<Light> lights = { Light{ Vector3(2, 5, 1) } };
+    float ambientStrength = 0.3f;
+    float specularStrength = 0.5f;
+    // Shadow rays per hit, at most MAX_LIGHT_SAMPLES. Scenes with no more lights
+    // than this light every hit with all of them; bigger ones pick lights by power.
+    int lightSamples = 4;
+    
+    // Running sum of the light powers, for pickLight(). Set by prepareLights().
+    std::vector<float> lightCdf;
+    
+    void prepareLights();
+    int shadowRaysPerHit() const {
+        return (int)std::min<size_t>(lights.size(), std::max(1, std::min(lightSamples, MAX_LIGHT_SAMPLES)));
+    }
+    // Light for u in [0, 1), with the probability it had of being picked
+    uint32_t pickLight(float u, float& probability) const;
+};
+
+inline float lightPower(const Light& light) {
+    return std::max(0.0f, (light.color.x + light.color.y + light.color.z) * (1.0f / 3.0f));
+}
+
+void ShadingParams::prepareLights() {
+    lightCdf.resize(lights.size());
+    float total = 0;
+    for (size_t i = 0; i < lights.size(); i++) {
+        total += lightPower(lights[i]);
+        lightCdf[i] = total;
+    }
+}
+
+// Binary search of the power CDF, uniform when the lights carry no power
+uint32_t ShadingParams::pickLight(float u, float& probability) const {
+    uint32_t count = (uint32_t)lights.size();
+    float total = lightCdf.size() == count && count > 0 ? lightCdf.back() : 0.0f;
+    if (total <= 0) {
+        probability = 1.0f / count;
+        return std::min(count - 1, (uint32_t)(u * count));
+    }
+    uint32_t index = (uint32_t)(std::upper_bound(lightCdf.begin(), lightCdf.end(), u * total) - lightCdf.begin());
+    index = std::min(index, count - 1);
+    probability = lightPower(lights[index]) / total;
+    return index;
+}
+
+// Geometry that is placed through instances instead of being baked into the
+// scene meshes. It has its own bottom-level BVH in local space.
+struct Prototype {
+    std::vector<Mesh> meshes;
+    BVH bvh;
+};
+
+// One placement of a prototype
+struct Instance {
+    uint32_t prototype;
+    uint32_t material;  // Replaces the prototype meshes' material
+    Transform toWorld;
+    Transform toLocal;
+    AABB bounds;        // World space
+};
+
+// Top-level BVH over instance bounds. Leaves hold runs of order, which lists
+// instance indices in leaf order.
+struct TopLevelBVH {
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> order;
+    
+    void build(const std::vector<Instance>& instances);
+    // Recomputes node bounds from the instance bounds, keeping the tree shape
+    void refit(const std::vector<Instance>& instances);
+    size_t memoryBytes() const { return nodes.capacity() * sizeof(BVHNode) + order.capacity() * sizeof(uint32_t); }
+    
+private:
+    void subdivide(const std::vector<Instance>& instances, uint32_t nodeIdx);
+};
+
+void TopLevelBVH::build(const std::vector<Instance>& instances) {
+    nodes.clear();
+    order.resize(instances.size());
+    for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+    if (instances.empty()) return;
+    
+    BVHNode root;
+    root.leftFirst = 0;
+    root.count = (uint32_t)instances.size();
+    nodes.push_back(root);
+    subdivide(instances, 0);
+    refit(instances);
+}
+
+// Median split along the widest axis of the instance centers, down to one
+// instance per leaf. Children always land after their parent, and halving keeps
+// the depth at most 32, well inside BVH_STACK_SIZE.
+void TopLevelBVH::subdivide(const std::vector<Instance>& instances, uint32_t nodeIdx) {
+    uint32_t first = nodes[nodeIdx].leftFirst;
+    uint32_t count = nodes[nodeIdx].count;
+    if (count <= 1) return;
+    
+    auto center = [&](uint32_t i) { return (instances[i].bounds.min + instances[i].bounds.max) * 0.5f; };
+    AABB centers;
+    for (uint32_t i = first; i < first + count; i++) centers.grow(center(order[i]));
+    Vector3 extent = centers.max - centers.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    
+    uint32_t half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+        [&](uint32_t a, uint32_t b) { return center(a)[axis] < center(b)[axis]; });
+    
+    uint32_t leftIdx = (uint32_t)nodes.size();
+    BVHNode left, right;
+    left.leftFirst = first;
+    left.count = half;
+    right.leftFirst = first + half;
+    right.count = count - half;
+    nodes.push_back(left);
+    nodes.push_back(right);
+    nodes[nodeIdx].leftFirst = leftIdx;
+    nodes[nodeIdx].count = 0;
+    subdivide(instances, leftIdx);
+    subdivide(instances, leftIdx + 1);
+}
+
+void TopLevelBVH::refit(const std::vector<Instance>& instances) {
+    for (size_t n = nodes.size(); n-- > 0; ) {
+        BVHNode& node = nodes[n];
+        node.bounds = AABB();
+        if (node.isLeaf()) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++)
+                node.bounds.grow(instances[order[i]].bounds);
+        } else {
+            node.bounds.grow(nodes[node.leftFirst].bounds);
+            node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+        }
+    }
+}
+
+// Everything the renderer traces against: the flat meshes under bvh, plus
+// instanced prototypes under a two-level hierarchy. Not copyable, since each
+// BVH points into its meshes.
+struct Scene {
+    std::vector<Mesh> meshes;
+    std::vector<Material> materials;
+    std::vector<Prototype> prototypes;
+    std::vector<Instance> instances;
+    ShadingParams shading;
+    BVH bvh;
+    TopLevelBVH topLevel;
+    
+    Scene() = default;
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+    
+    uint32_t addMaterial(const Material& material) {
+        materials.push_back(material);
+        return (uint32_t)materials.size() - 1;
+    }
+    // Prototypes must all be added before buildInstances(), which points their BVHs at them
+    uint32_t addPrototype(Mesh mesh) {
+        prototypes.emplace_back();
+        prototypes.back().meshes.push_back(std::move(mesh));
+        return (uint32_t)prototypes.size() - 1;
+    }
+    uint32_t addInstance(uint32_t prototype, const Transform& toWorld, uint32_t material);
+    // Moves an instance. Call refitInstances() once all moves are done.
+    void setInstanceTransform(uint32_t instance, const Transform& toWorld);
+    void refitInstances() { topLevel.refit(instances); }
+    
+    void build(TriangleLayout layout = TriangleLayout::Precomputed, BVHBuilder builder = BVHBuilder::Sweep,
+               ThreadPool* pool = nullptr) {
+        bvh.build(meshes, layout, builder, pool);
+        buildInstances(layout, builder, pool);
+        shading.prepareLights();
+    }
+    // Compresses the flat geometry's BVH and every prototype's (see BVH::compress())
+    bool compress(bool vertices) {
+        bool ok = bvh.prims.empty() || bvh.compress(vertices);
+        for (Prototype& prototype : prototypes) {
+            if (!prototype.bvh.prims.empty() && !prototype.bvh.compress(vertices)) ok = false;
+        }
+        return ok;
+    }
+    // Follows the flat meshes after their vertices moved, keeping the topology (see BVH::refit())
+    BVHRefitStats refit(ThreadPool* pool = nullptr) { return bvh.refit(pool); }
+    // Bottom-level BVHs of every prototype, then the top level over the instances
+    void buildInstances(TriangleLayout layout, BVHBuilder builder, ThreadPool* pool);
+    
+    bool intersect(const Ray& ray, HitRecord& hit) const;
+    bool occluded(const Ray& ray, float tMax) const;
+    const Mesh& hitMesh(uint32_t instance, uint32_t mesh) const {
+        return instance == NO_PRIMITIVE ? meshes[mesh] : prototypes[instances[instance].prototype].meshes[mesh];
+    }
+    // The instance's material replaces its prototype's, except on faces the OBJ assigned one to
+    uint32_t instanceMaterial(uint32_t instance, uint32_t mesh, uint32_t triangle) const {
+        const Mesh& m = hitMesh(instance, mesh);
+        return m.triangleMaterials.empty() ? instances[instance].material : m.materialOf(triangle);
+    }
+    
+    // Box around the flat geometry and every instance
+    AABB bounds() const {
+        AABB box;
+        box.grow(bvh.bounds());
+        if (!topLevel.nodes.empty()) box.grow(topLevel.nodes[0].bounds);
+        return box;
+    }
+    
+    // Triangles as rendered, counting every instance
+    size_t triangleCount() const {
+        size_t count = bvh.prims.size();
+        for (const Instance& instance : instances) count += prototypes[instance.prototype].bvh.prims.size();
+        return count;
+    }
+    size_t meshBytes() const {
+        size_t bytes = 0;
+        auto add = [&](const Mesh& mesh) {
+            bytes += mesh.vertices.capacity() * sizeof(Vector3) + mesh.indices.capacity() * sizeof(uint32_t);
+        };
+        for (const auto& mesh : meshes) add(mesh);
+        for (const auto& prototype : prototypes) for (const auto& mesh : prototype.meshes) add(mesh);
+        return bytes;
+    }
+    size_t bvhBytes() const {
+        size_t bytes = bvh.memoryBytes() + topLevel.memoryBytes() + instances.capacity() * sizeof(Instance);
+        for (const auto& prototype : prototypes) bytes += prototype.bvh.memoryBytes();
+        return bytes;
+    }
+    
+private:
+    bool intersectInstances(const Ray& ray, HitRecord& hit) const;
+    bool occludedInstances(const Ray& ray, float tMax) const;
+    void updateInstanceBounds(Instance& instance) const;
+};
+
+void Scene::updateInstanceBounds(Instance& instance) const {
+    const BVH& local = prototypes[instance.prototype].bvh;
+    instance.bounds = AABB();
+    if (local.prims.empty()) return;
+    const AABB box = local.bounds();
+    for (int corner = 0; corner < 8; corner++) {
+        Vector3 p(corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y,
+                  corner & 4 ? box.max.z : box.min.z);
+        instance.bounds.grow(instance.toWorld.point(p));
+    }
+}
+
+uint32_t Scene::addInstance(uint32_t prototype, const Transform& toWorld, uint32_t material) {
+    Instance instance;
+    instance.prototype = prototype;
+    instance.material = material;
+    instance.toWorld = toWorld;
+    instance.toLocal = toWorld.inverse();
+    instances.push_back(instance);
+    return (uint32_t)instances.size() - 1;
+}
+
+void Scene::setInstanceTransform(uint32_t index, const Transform& toWorld) {
+    Instance& instance = instances[index];
+    instance.toWorld = toWorld;
+    instance.toLocal = toWorld.inverse();
+    updateInstanceBounds(instance);
+}
+
+void Scene::buildInstances(TriangleLayout layout, BVHBuilder builder, ThreadPool* pool) {
+    for (auto& prototype : prototypes) prototype.bvh.build(prototype.meshes, layout, builder, pool);
+    for (auto& instance : instances) updateInstanceBounds(instance);
+    topLevel.build(instances);
+}
+
+bool Scene::intersect(const Ray& ray, HitRecord& hit) const {
+    bool found = bvh.intersect(ray, hit);
+    if (!instances.empty() && intersectInstances(ray, hit)) found = true;
+    return found;
+}
+
+bool Scene::occluded(const Ray& ray, float tMax) const {
+    return bvh.occluded(ray, tMax) || (!instances.empty() && occludedInstances(ray, tMax));
+}
+
+// Walks the top level like BVH::intersect(). At a leaf the ray moves into the
+// instance's local space. The direction is not renormalized, so distances along
+// it stay in world units and hit.distance bounds the bottom-level search as is.
+bool Scene::intersectInstances(const Ray& ray, HitRecord& hit) const {
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    if (intersectAABB(topLevel.nodes[0].bounds, ray, invDir, hit.distance) == FLT_MAX) return false;
+    
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stackSize = 0;
+    uint32_t nodeIdx = 0;
+    bool found = false;
+    
+    while (true) {
+        const BVHNode& node = topLevel.nodes[nodeIdx];
+        RT_STAT_ADD(nodeVisits, 1);
+        if (node.isLeaf()) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                uint32_t index = topLevel.order[i];
+                const Instance& instance = instances[index];
+                Ray local{ instance.toLocal.point(ray.origin), instance.toLocal.vector(ray.direction) };
+                const BVH& bvh = prototypes[instance.prototype].bvh;
+                if (bvh.intersect(local, hit)) {
+                    const PrimRef& prim = bvh.prims[hit.primitive];
+                    hit.position = ray.pointAt(hit.distance);
+                    hit.normal = normalize(instance.toLocal.transposedVector(hit.normal));
+                    hit.material = instanceMaterial(index, prim.mesh, prim.triangle);
+                    hit.instance = index;
+                    found = true;
+                }
+            }
+            if (stackSize == 0) break;
+            nodeIdx = stack[--stackSize];
+            continue;
+        }
+        
+        uint32_t nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+        float tNear = intersectAABB(topLevel.nodes[nearChild].bounds, ray, invDir, hit.distance);
+        float tFar = intersectAABB(topLevel.nodes[farChild].bounds, ray, invDir, hit.distance);
+        if (tFar < tNear) {
+            std::swap(nearChild, farChild);
+            std::swap(tNear, tFar);
+        }
+        
+        if (tNear == FLT_MAX) {
+            if (stackSize == 0) break;
+            nodeIdx = stack[--stackSize];
+        } else {
+            nodeIdx = nearChild;
+            if (tFar != FLT_MAX) stack[stackSize++] = farChild;
+        }
+    }
+    return found;
+}
+
+bool Scene::occludedInstances(const Ray& ray, float tMax) const {
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = 0;
+    
+    while (stackSize > 0) {
+        const BVHNode& node = topLevel.nodes[stack[--stackSize]];
+        RT_STAT_ADD(nodeVisits, 1);
+        if (intersectAABB(node.bounds, ray, invDir, tMax) == FLT_MAX) continue;
+        
+        if (node.isLeaf()) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                const Instance& instance = instances[topLevel.order[i]];
+                Ray local{ instance.toLocal.point(ray.origin), instance.toLocal.vector(ray.direction) };
+                if (prototypes[instance.prototype].bvh.occluded(local, tMax)) return true;
+            }
+        } else {
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst;
+        }
+    }
+    return false;
+}
+
+const Vector3 BACKGROUND_COLOR(0.2f, 0.7f, 0.8f);
+const int MAX_DEPTH = 3;
+
+// One light's share of a hit's shading. diffuse and specular only count if
+// shadowRay reaches the light.
+struct LightSample {
+    Ray shadowRay;
+    float distance;
+    Vector3 diffuse;
+    Vector3 specular;
+};
+
+// Local shading at a hit, split out so the recursive and wavefront renderers
+// share it
+struct ShadingSample {
+    Vector3 ambient;
+    LightSample lights[MAX_LIGHT_SAMPLES];
+    int lightCount = 0;
+    bool reflective;
+    float reflectivity; // Weight of the reflectRay color
+    Ray reflectRay;
+};
+
+// Precise shading is the reference. Fast replaces pow() with repeated squaring
+// and each normalize with one reciprocal square root, which moves shadow and
+// reflection rays by a few units in the last place. The shading functions take
+// it as a template parameter, so either path compiles without runtime checks.
+enum class ShadingPrecision { Precise, Fast };
+
+// x^n by repeated squaring
+inline float powInt(float x, uint32_t n) {
+    float result = 1.0f;
+    for (; n > 0; n >>= 1) {
+        if (n & 1) result *= x;
+        x *= x;
+    }
+    return result;
+}
+
+// 1 / sqrt(x) from the hardware estimate plus one Newton step, about 23 bits
+inline float fastInverseSqrt(float x) {
+#if defined(RT_HAVE_X86_SIMD) && (defined(__SSE__) || defined(_M_X64))
+    float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return estimate * (1.5f - 0.5f * x * estimate * estimate);
+#else
+    return 1.0f / std::sqrt(x);
+#endif
+}
+
+// Random numbers for light sampling, hashed from the hit position so renders
+// repeat exactly. The BVH slot depends on the builder and is not restored from a
+// G-buffer, so it stays out of the hash.
+inline uint32_t hashHit(const HitRecord& hit, uint32_t salt) {
+    uint32_t bits[3];
+    std::memcpy(bits, &hit.position, sizeof(bits));
+    uint32_t h = salt * 0x9e3779b9u;
+    for (uint32_t b : bits) {
+        h ^= b;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+    }
+    return h;
+}
+
+inline float unitFloat(uint32_t h) { return (h >> 8) * (1.0f / 16777216.0f); }
+
+// A point on the light to aim the shadow ray at: the center of a point light,
+// a uniformly picked point on the sphere of an area light
+inline Vector3 lightSamplePoint(const Light& light, const HitRecord& hit, uint32_t salt) {
+    if (light.radius <= 0) return light.position;
+    uint32_t h = hashHit(hit, salt);
+    float z = 1 - 2 * unitFloat(h);
+    float phi = 2 * PI * unitFloat(h * 0x9e3779b9u + 0x632be5abu);
+    float r = std::sqrt(std::max(0.0f, 1 - z * z));
+    return light.position + Vector3(r * std::cos(phi), r * std::sin(phi), z) * light.radius;
+}
+
+// Adds the Phong terms of one light, scaled by weight, and its shadow ray
+template <ShadingPrecision P>
+void addLightSample(ShadingSample& sample, const Scene& scene, const Material& material, const HitRecord& hit,
+                    const Vector3& viewDir, const Light& light, Vector3 lightPoint, float weight) {
+    LightSample& out = sample.lights[sample.lightCount++];
+    Vector3 toLight = lightPoint - hit.position;
+    Vector3 lightDir;
+    if constexpr (P == ShadingPrecision::Fast) {
+        // One light vector for both the direction and the shadow distance
+        float lightSquared = std::max(dot(toLight, toLight), 1e-30f);
+        float invLight = fastInverseSqrt(lightSquared);
+        out.distance = lightSquared * invLight;
+        lightDir = toLight * invLight;
+    } else {
+        out.distance = length(toLight);
+        lightDir = normalize(toLight);
+    }
+    Vector3 reflectDir = reflect(-lightDir, hit.normal);
+    
+    // Diffuse lighting
+    float diff = std::max(0.0f, dot(hit.normal, lightDir));
+    out.diffuse = multiply(material.color * diff, light.color) * weight;
+    
+    // Specular lighting
+    float specBase = std::max(0.0f, dot(viewDir, reflectDir));
+    float spec;
+    uint32_t integerExponent = (uint32_t)material.specularExponent;
+    if (P == ShadingPrecision::Fast && (float)integerExponent == material.specularExponent)
+        spec = powInt(specBase, integerExponent);
+    else
+        spec = (float)std::pow((double)specBase, (double)material.specularExponent);
+    out.specular = multiply(Vector3(1,1,1) * spec * scene.shading.specularStrength, light.color) * weight;
+    
+    // Shadow ray
+    out.shadowRay.origin = hit.position + hit.normal * EPSILON;
+    out.shadowRay.direction = lightDir;
+}
+
+template <ShadingPrecision P>
+ShadingSample shadeHit(const Scene& scene, const Ray& ray, const HitRecord& hit) {
+    ShadingSample sample;
+    const ShadingParams& params = scene.shading;
+    
+    // Material properties
+    const Material& material = scene.materials[hit.material];
+    Vector3 materialColor = material.color;
+    sample.ambient = materialColor * params.ambientStrength;
+    
+    Vector3 viewDir;
+    if constexpr (P == ShadingPrecision::Fast) {
+        Vector3 toEye = ray.origin - hit.position;
+        viewDir = toEye * fastInverseSqrt(std::max(dot(toEye, toEye), 1e-30f));
+    } else {
+        viewDir = normalize(ray.origin - hit.position);
+    }
+    
+    // Every light when there are few enough, otherwise a fixed number of them
+    // picked by power, stratified over [0, 1) and weighted by 1 / (samples * probability)
+    int samples = params.shadowRaysPerHit();
+    if ((size_t)samples == params.lights.size()) {
+        for (int i = 0; i < samples; i++) {
+            const Light& light = params.lights[i];
+            addLightSample<P>(sample, scene, material, hit, viewDir, light, lightSamplePoint(light, hit, i), 1.0f);
+        }
+    } else {
+        float offset = unitFloat(hashHit(hit, MAX_LIGHT_SAMPLES));
+        for (int i = 0; i < samples; i++) {
+            float probability;
+            const Light& light = params.lights[params.pickLight((i + offset) / samples, probability)];
+            addLightSample<P>(sample, scene, material, hit, viewDir, light, lightSamplePoint(light, hit, i),
+                              1.0f / (samples * probability));
+        }
+    }
+    
+    // Reflection for shiny surfaces
+    sample.reflectivity = material.reflectivity;
+    sample.reflective = material.reflectivity > 0.0f;
+    if (sample.reflective) {
+        sample.reflectRay.origin = hit.position + hit.normal * EPSILON;
+        sample.reflectRay.direction = reflect(ray.direction, hit.normal);
+    }
+    return sample;
+}
+
+template <ShadingPrecision P = ShadingPrecision::Precise>
+Vector3 trace(const Ray& ray, const Scene& scene, int depth = 0);
+
+// Shades an already intersected ray and follows its shadow and reflection rays
+template <ShadingPrecision P = ShadingPrecision::Precise>
+Vector3 traceHit(const Ray& ray, const Scene& scene, const HitRecord& closestHit, int depth) {
+    if (closestHit.primitive == NO_PRIMITIVE) {
+        RT_STAT_ADD(misses, 1);
+        return BACKGROUND_COLOR;
+    }
+    RT_STAT_ADD(hits, 1);
+
+    ShadingSample shading = shadeHit<P>(scene, ray, closestHit);
+    
+    // Shadow checks
+    RT_STAT_ADD(shadowRays, shading.lightCount);
+    bool lit[MAX_LIGHT_SAMPLES];
+    for (int i = 0; i < shading.lightCount; i++)
+        lit[i] = !scene.occluded(shading.lights[i].shadowRay, shading.lights[i].distance);
+    
+    Vector3 reflection(0,0,0);
+    if (depth < MAX_DEPTH && shading.reflective) {
+        RT_STAT_ADD(reflectionRays, 1);
+        reflection = trace<P>(shading.reflectRay, scene, depth+1) * shading.reflectivity;
+    }
+
+    // Combine lighting
+    Vector3 result = shading.ambient;
+    for (int i = 0; i < shading.lightCount; i++) {
+        if (lit[i]) result = result + shading.lights[i].diffuse + shading.lights[i].specular;
+    }
+    
+    return result + reflection;
+}
+
+template <ShadingPrecision P>
+Vector3 trace(const Ray& ray, const Scene& scene, int depth) {
+    if (depth > MAX_DEPTH) return Vector3(0, 0, 0); // Prevent infinite recursion
+    
+    HitRecord closestHit;
+    scene.intersect(ray, closestHit);
+    return traceHit<P>(ray, scene, closestHit, depth);
+}
+
+// 64-bit hash for cache keys. Takes 8-byte words through four independent
+// multiply-rotate lanes, so the multiplies overlap instead of forming one chain
+// per byte, and folds the lanes and the tail together at the end.
+const uint64_t HASH_SEED = 0xcbf29ce484222325ull;
+
+inline uint64_t hashWord(uint64_t h, uint64_t word) {
+    h ^= word * 0x9e3779b97f4a7c15ull;
+    return (h << 31 | h >> 33) * 0xff51afd7ed558ccdull;
+}
+
+inline uint64_t hashBytes(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t lanes[4] = { h, h ^ 1, h ^ 2, h ^ 3 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, p + i + 8 * lane, 8);
+            lanes[lane] = hashWord(lanes[lane], word);
+        }
+    }
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        lanes[0] = hashWord(lanes[0], word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p + i, size - i);
+    h = hashWord(lanes[0], tail ^ (uint64_t)size << 56);
+    for (int lane = 1; lane < 4; lane++) h = hashWord(h, lanes[lane]);
+    return h;
+}
+
+inline uint64_t hashMesh(uint64_t h, const Mesh& mesh) {
+    h = hashBytes(h, &mesh.doubleSided, sizeof(mesh.doubleSided));
+    h = hashBytes(h, mesh.vertices.data(), mesh.vertices.size() * sizeof(Vector3));
+    return hashBytes(h, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+}
+
+// One pixel's primary hit, everything needed to shade it again without a traversal
+struct GBufferSample {
+    Vector3 position;
+    Vector3 normal;
+    float distance;
+    float u, v;
+    uint32_t mesh;      // NO_PRIMITIVE for a miss, GBUFFER_UNCACHED to trace again
+    uint32_t triangle;
+    uint32_t instance;  // As in HitRecord
+};
+
+// Pixels that saw a tracksLight mesh, whose hit may be stale after a light edit
+const uint32_t GBUFFER_UNCACHED = NO_PRIMITIVE - 1;
+
+// Primary hits of a whole image, saved between runs. The key covers the static
+// geometry, camera and resolution, so edits that only touch ShadingParams or
+// material colors reuse it and skip primary traversal. tracksLight meshes are
+// left out of the key and tested directly against every cached ray instead.
+struct GBuffer {
+    uint64_t key = 0;
+    int width = 0, height = 0;
+    bool valid = false; // samples hold the hits for key, otherwise the render fills them in
+    std::vector<GBufferSample> samples;
+    
+    void reset(uint64_t sceneKey, int w, int h);
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+    void store(const Scene& scene, size_t pixel, const HitRecord& hit);
+    HitRecord primaryHit(const Scene& scene, const Ray& ray, size_t pixel) const;
+};
+
+uint64_t gbufferKey(const Scene& scene, const Camera& camera, int width, int height) {
+    uint64_t h = HASH_SEED;
+    h = hashBytes(h, &camera, sizeof(camera));
+    h = hashBytes(h, &width, sizeof(width));
+    h = hashBytes(h, &height, sizeof(height));
+    for (uint32_t m = 0; m < scene.meshes.size(); m++) {
+        const Mesh& mesh = scene.meshes[m];
+        if (mesh.tracksLight) continue;
+        h = hashBytes(h, &m, sizeof(m));
+        h = hashMesh(h, mesh);
+    }
+    for (const Prototype& prototype : scene.prototypes) {
+        for (const Mesh& mesh : prototype.meshes) h = hashMesh(h, mesh);
+    }
+    for (const Instance& instance : scene.instances) {
+        h = hashBytes(h, &instance.prototype, sizeof(instance.prototype));
+        h = hashBytes(h, &instance.toWorld, sizeof(instance.toWorld));
+    }
+    return h;
+}
+
+void GBuffer::reset(uint64_t sceneKey, int w, int h) {
+    key = sceneKey;
+    width = w;
+    height = h;
+    valid = false;
+    samples.assign((size_t)w * h, GBufferSample());
+}
+
+const uint32_t GBUFFER_MAGIC = 0x42475452; // "RTGB"
+const uint32_t GBUFFER_VERSION = 2;
+
+// Loads the file if it was saved for the current key and resolution
+bool GBuffer::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    
+    uint32_t magic = 0, version = 0;
+    uint64_t fileKey = 0;
+    int32_t w = 0, h = 0;
+    file.read((char*)&magic, sizeof(magic));
+    file.read((char*)&version, sizeof(version));
+    file.read((char*)&fileKey, sizeof(fileKey));
+    file.read((char*)&w, sizeof(w));
+    file.read((char*)&h, sizeof(h));
+    if (!file || magic != GBUFFER_MAGIC || version != GBUFFER_VERSION) {
+        std::cerr << "Ignoring unreadable G-buffer " << path << "\n";
+        return false;
+    }
+    if (fileKey != key || w != width || h != height) {
+        std::cerr << "G-buffer " << path << " is for a different scene or camera, tracing primary rays\n";
+        return false;
+    }
+    
+    file.read((char*)samples.data(), samples.size() * sizeof(GBufferSample));
+    valid = (bool)file;
+    if (!valid) std::cerr << "Ignoring truncated G-buffer " << path << "\n";
+    return valid;
+}
+
+bool GBuffer::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error opening G-buffer file: " << path << "\n";
+        return false;
+    }
+    int32_t w = width, h = height;
+    file.write((const char*)&GBUFFER_MAGIC, sizeof(GBUFFER_MAGIC));
+    file.write((const char*)&GBUFFER_VERSION, sizeof(GBUFFER_VERSION));
+    file.write((const char*)&key, sizeof(key));
+    file.write((const char*)&w, sizeof(w));
+    file.write((const char*)&h, sizeof(h));
+    file.write((const char*)samples.data(), samples.size() * sizeof(GBufferSample));
+    return (bool)file;
+}
+
+void GBuffer::store(const Scene& scene, size_t pixel, const HitRecord& hit) {
+    GBufferSample& s = samples[pixel];
+    s.mesh = NO_PRIMITIVE;
+    if (hit.primitive == NO_PRIMITIVE) return;
+    
+    const BVH& bvh = hit.instance == NO_PRIMITIVE ? scene.bvh : scene.prototypes[scene.instances[hit.instance].prototype].bvh;
+    const PrimRef& prim = bvh.prims[hit.primitive];
+    if (scene.hitMesh(hit.instance, prim.mesh).tracksLight) {
+        s.mesh = GBUFFER_UNCACHED;
+        return;
+    }
+    s.position = hit.position;
+    s.normal = hit.normal;
+    s.distance = hit.distance;
+    s.u = hit.u;
+    s.v = hit.v;
+    s.mesh = prim.mesh;
+    s.triangle = prim.triangle;
+    s.instance = hit.instance;
+}
+
+// The cached hit, unless a tracksLight mesh now sits in front of it
+HitRecord GBuffer::primaryHit(const Scene& scene, const Ray& ray, size_t pixel) const {
+    const GBufferSample& s = samples[pixel];
+    HitRecord hit;
+    if (s.mesh == GBUFFER_UNCACHED) {
+        scene.intersect(ray, hit);
+        return hit;
+    }
+    if (s.mesh != NO_PRIMITIVE) {
+        // Shading only checks the slot against NO_PRIMITIVE and seeds light
+        // sampling from the position (see hashHit), so any slot will do
+        hit.position = s.position;
+        hit.normal = s.normal;
+        hit.distance = s.distance;
+        hit.u = s.u;
+        hit.v = s.v;
+        hit.primitive = 0;
+        hit.instance = s.instance;
+        hit.material = s.instance == NO_PRIMITIVE ? scene.meshes[s.mesh].materialOf(s.triangle)
+                                                  : scene.instanceMaterial(s.instance, s.mesh, s.triangle);
+    }
+    
+    for (const Mesh& mesh : scene.meshes) {
+        if (!mesh.tracksLight) continue;
+        uint32_t closest = NO_PRIMITIVE;
+        for (uint32_t t = 0; t < mesh.triangleCount(); t++) {
+            if (intersectTriangle(mesh, t, 0, ray, hit)) closest = t;
+        }
+        RT_STAT_ADD(triangleTests, mesh.triangleCount());
+        if (closest == NO_PRIMITIVE) continue;
+
+        // Same as BVH::finalizeHit() for the Indexed layout
+        const Vector3& v0 = mesh.vertex(closest, 0);
+        hit.position = ray.pointAt(hit.distance);
+        hit.normal = normalize(cross(mesh.vertex(closest, 1) - v0, mesh.vertex(closest, 2) - v0));
+        if (mesh.doubleSided && dot(hit.normal, ray.direction) > 0) hit.normal = -hit.normal;
+        hit.material = mesh.materialOf(closest);
+        hit.instance = NO_PRIMITIVE;
+    }
+    return hit;
+}
+
+const int TILE_SIZE = 16;
+
+// Pixels [x0, x1) x [y0, y1) of an image. Tiles render into buffers of their
+// own, where pixel (x, y) is local index (y - y0) * width() + (x - x0).
+struct TileRect {
+    int x0, y0, x1, y1;
+    
+    int width() const { return x1 - x0; }
+    uint32_t pixelCount() const { return (uint32_t)((x1 - x0) * (y1 - y0)); }
+    size_t imageIndex(uint32_t local, int imageWidth) const {
+        return (size_t)(y0 + (int)local / width()) * imageWidth + x0 + local % width();
+    }
+};
+
+// (jx, jy) is the sample position inside the pixel, the center by default
+Ray computePrimRay(int x, int y, int width, int height, const Camera& camera, float jx = 0.5f, float jy = 0.5f) {
+    float aspect = width / (float)height;
+    float scale = tan(60 * 0.5 * PI / 180);
+    
+    float px = (2 * ((x + (double)jx) / width) - 1) * aspect * scale;
+    float py = (1 - 2 * ((y + (double)jy) / height)) * scale;
+    
+    Vector3 direction = camera.right * px + camera.up * py + camera.forward;
+    direction = normalize(direction);
+    
+    return Ray{camera.position, direction};
+}
+
+// Wavefront renderer. Instead of recursing per pixel, a whole tile moves through
+// the pipeline one stage at a time: every ray of a bounce is intersected as one
+// batch, the hits are compacted and shaded together, and the shadow and
+// reflection rays they spawn are queued for their own batched stages.
+const int WAVEFRONT_TILE_SIZE = 64;
+
+// A ray in flight and where its contribution goes
+struct PathState {
+    Ray ray;
+    uint32_t pixel;   // Index into the band
+    float weight;     // Product of the reflectivities along the path, like trace()
+};
+
+struct ShadowState {
+    Ray ray;
+    float distance;
+    uint32_t pixel;
+    Vector3 contribution; // Added to the pixel if the light is visible
+};
+
+// One tile's queues, in the arena of the thread rendering it. Every bounce
+// spawns at most one reflection ray and shadowsPerPath shadow rays per path
+// (see ShadingParams::shadowRaysPerHit), so no queue ever outgrows the number
+// of primary paths times that.
+struct WavefrontQueues {
+    ScratchArray<PathState> paths, nextPaths;
+    ScratchArray<HitRecord> hits;
+    ScratchArray<uint32_t> hitIndices;
+    ScratchArray<ShadowState> shadows;
+    ScratchArray<uint64_t> sortKeys;
+    
+    void allocate(Arena& arena, uint32_t maxPaths, uint32_t shadowsPerPath) {
+        paths.allocate(arena, maxPaths);
+        nextPaths.allocate(arena, maxPaths);
+        hits.allocate(arena, maxPaths);
+        hitIndices.allocate(arena, maxPaths);
+        shadows.allocate(arena, maxPaths * shadowsPerPath);
+        sortKeys.allocate(arena, maxPaths);
+    }
+    static size_t bytesFor(uint32_t maxPaths, uint32_t shadowsPerPath) {
+        return 2 * Arena::bytesFor<PathState>(maxPaths) + Arena::bytesFor<HitRecord>(maxPaths) +
+               Arena::bytesFor<uint32_t>(maxPaths) + Arena::bytesFor<ShadowState>(maxPaths * shadowsPerPath) +
+               Arena::bytesFor<uint64_t>(maxPaths);
+    }
+};
+
+// Smaller batches are not worth sorting
+const uint32_t MIN_SORTED_PATHS = 256;
+
+// Coherence bin of a ray: its direction octant on top, then the Morton code of
+// its origin cell in the scene box, 9 bits per axis
+inline uint32_t rayBinKey(const Ray& ray, const AABB& bounds, const Vector3& invExtent) {
+    uint32_t octant = (ray.direction.x < 0 ? 4u : 0u) | (ray.direction.y < 0 ? 2u : 0u) | (ray.direction.z < 0 ? 1u : 0u);
+    Vector3 p = ray.origin - bounds.min;
+    return (octant << 27) | (morton3D(p.x * invExtent.x, p.y * invExtent.y, p.z * invExtent.z) >> 3);
+}
+
+// Reorders the secondary rays in q.paths by coherence bin, so consecutive rays
+// start close together and head the same way and walk mostly the same BVH
+// nodes. Paths add to their own pixel only and each pixel has at most one path
+// per bounce, so the order changes nothing in the image.
+void sortStage(const Scene& scene, WavefrontQueues& q) {
+    if (q.paths.size() < MIN_SORTED_PATHS) return;
+    AABB bounds = scene.bounds();
+    Vector3 extent = bounds.max - bounds.min;
+    Vector3 invExtent(extent.x > 0 ? 1 / extent.x : 0, extent.y > 0 ? 1 / extent.y : 0, extent.z > 0 ? 1 / extent.z : 0);
+    
+    // Key in the high half, path index in the low half: sorting is stable and in place
+    q.sortKeys.clear();
+    for (uint32_t i = 0; i < q.paths.size(); i++)
+        q.sortKeys.push_back((uint64_t)rayBinKey(q.paths[i].ray, bounds, invExtent) << 32 | i);
+    std::sort(q.sortKeys.begin(), q.sortKeys.end());
+    
+    q.nextPaths.clear();
+    for (uint64_t key : q.sortKeys) q.nextPaths.push_back(q.paths[(uint32_t)key]);
+    std::swap(q.paths, q.nextPaths);
+}
+
+void intersectStage(const Scene& scene, WavefrontQueues& q, uint32_t* costs) {
+    q.hits.assign(q.paths.size(), HitRecord());
+    for (size_t i = 0; i < q.paths.size(); i++) {
+        uint64_t costBefore = threadStats.cost();
+        scene.intersect(q.paths[i].ray, q.hits[i]);
+        if (costs) costs[q.paths[i].pixel] += (uint32_t)(threadStats.cost() - costBefore);
+    }
+}
+
+template <ShadingPrecision P>
+void shadeStage(const Scene& scene, WavefrontQueues& q, int depth, Vector3* band) {
+    // Misses resolve to background right away, hits are compacted for shading
+    q.hitIndices.clear();
+    for (uint32_t i = 0; i < q.paths.size(); i++) {
+        const PathState& path = q.paths[i];
+        if (q.hits[i].primitive == NO_PRIMITIVE) {
+            RT_STAT_ADD(misses, 1);
+            band[path.pixel] = band[path.pixel] + BACKGROUND_COLOR * path.weight;
+        } else {
+            RT_STAT_ADD(hits, 1);
+            q.hitIndices.push_back(i);
+        }
+    }
+    
+    q.shadows.clear();
+    q.nextPaths.clear();
+    for (uint32_t i : q.hitIndices) {
+        const PathState& path = q.paths[i];
+        ShadingSample shading = shadeHit<P>(scene, path.ray, q.hits[i]);
+        band[path.pixel] = band[path.pixel] + shading.ambient * path.weight;
+        for (int l = 0; l < shading.lightCount; l++) {
+            const LightSample& light = shading.lights[l];
+            q.shadows.push_back(ShadowState{ light.shadowRay, light.distance, path.pixel,
+                                             (light.diffuse + light.specular) * path.weight });
+        }
+        if (depth < MAX_DEPTH && shading.reflective)
+            q.nextPaths.push_back(PathState{ shading.reflectRay, path.pixel, path.weight * shading.reflectivity });
+    }
+}
+
+void shadowStage(const Scene& scene, WavefrontQueues& q, Vector3* band, uint32_t* costs) {
+    RT_STAT_ADD(shadowRays, q.shadows.size());
+    for (const ShadowState& shadow : q.shadows) {
+        uint64_t costBefore = threadStats.cost();
+        if (!scene.occluded(shadow.ray, shadow.distance))
+            band[shadow.pixel] = band[shadow.pixel] + shadow.contribution;
+        if (costs) costs[shadow.pixel] += (uint32_t)(threadStats.cost() - costBefore);
+    }
+}
+
+// The G-buffer a tile's primary hits go through, and where the tile sits in it
+struct GBufferTile {
+    GBuffer* gbuffer;
+    const TileRect& rect;
+    int imageWidth;
+};
+
+// First bounce through the G-buffer: read back cached hits, or trace and record them.
+// A path's pixel is its tile-local index.
+void primaryStage(const Scene& scene, WavefrontQueues& q, uint32_t* costs, const GBufferTile& tile) {
+    GBuffer& gbuffer = *tile.gbuffer;
+    if (!gbuffer.valid) {
+        intersectStage(scene, q, costs);
+        for (size_t i = 0; i < q.paths.size(); i++)
+            gbuffer.store(scene, tile.rect.imageIndex(q.paths[i].pixel, tile.imageWidth), q.hits[i]);
+        return;
+    }
+    q.hits.resize(q.paths.size());
+    for (size_t i = 0; i < q.paths.size(); i++) {
+        uint64_t costBefore = threadStats.cost();
+        q.hits[i] = gbuffer.primaryHit(scene, q.paths[i].ray, tile.rect.imageIndex(q.paths[i].pixel, tile.imageWidth));
+        if (costs) costs[q.paths[i].pixel] += (uint32_t)(threadStats.cost() - costBefore);
+    }
+}
+
+// Runs the queued q.paths through every bounce. Each path's pixel indexes out
+// (and costs), which must start out zeroed. sortRays bins the secondary rays
+// of every bounce before they are traced; primary rays are coherent already.
+template <ShadingPrecision P = ShadingPrecision::Precise>
+void traceWavefront(const Scene& scene, WavefrontQueues& q, Vector3* out, uint32_t* costs,
+                    const GBufferTile* gbuffer = nullptr, bool sortRays = true) {
+    for (int depth = 0; depth <= MAX_DEPTH && !q.paths.empty(); depth++) {
+        if (depth > 0 && sortRays) sortStage(scene, q);
+        if (depth == 0 && gbuffer) primaryStage(scene, q, costs, *gbuffer);
+        else intersectStage(scene, q, costs);
+        shadeStage<P>(scene, q, depth, out);
+        shadowStage(scene, q, out, costs);
+        RT_STAT_ADD(reflectionRays, q.nextPaths.size());
+        std::swap(q.paths, q.nextPaths);
+    }
+}
+
+// Renders the pixels of one tile into pixels (and costs), both tile-local
+void renderTileWavefront(const Scene& scene, const Camera& camera, int width, int height, const TileRect& rect,
+                         Vector3* pixels, uint32_t* costs, WavefrontQueues& q, GBuffer* gbuffer,
+                         ShadingPrecision precision, bool sortRays) {
+    q.paths.clear();
+    for (int y = rect.y0; y < rect.y1; y++) {
+        for (int x = rect.x0; x < rect.x1; x++) {
+            uint32_t pixel = (uint32_t)q.paths.size();
+            pixels[pixel] = Vector3(0, 0, 0);
+            if (costs) costs[pixel] = 0;
+            q.paths.push_back(PathState{ computePrimRay(x, y, width, height, camera), pixel, 1.0f });
+        }
+    }
+    RT_STAT_ADD(primaryRays, q.paths.size());
+    GBufferTile tile = { gbuffer, rect, width };
+    const GBufferTile* primary = gbuffer ? &tile : nullptr;
+    if (precision == ShadingPrecision::Fast)
+        traceWavefront<ShadingPrecision::Fast>(scene, q, pixels, costs, primary, sortRays);
+    else
+        traceWavefront(scene, q, pixels, costs, primary, sortRays);
+}
+
+// How a TiledFramebuffer stores finished pixels. Float keeps them exact, Half
+// (three IEEE half floats) and RGBE (Ward's shared exponent) trade precision
+// for a half or a third of the memory.
+enum class PixelFormat : uint8_t { Float, Half, RGBE };
+
+const char* pixelFormatName(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::Half: return "half";
+        case PixelFormat::RGBE: return "rgbe";
+        default: return "float";
+    }
+}
+
+size_t pixelFormatBytes(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::Half: return 3 * sizeof(uint16_t);
+        case PixelFormat::RGBE: return 4;
+        default: return sizeof(Vector3);
+    }
+}
+
+// Round to nearest. Values past the half range become infinity, tiny ones
+// denormals or zero.
+uint16_t floatToHalf(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0); // Inf, NaN
+    if (exponent >= 31) return sign | 0x7c00;
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1) half++;
+        return sign | (uint16_t)half;
+    }
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000) half++; // A carry into the exponent is still the right rounding
+    return sign | (uint16_t)half;
+}
+
+float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0) {
+        float f = std::ldexp((float)mantissa, -24);
+        return sign ? -f : f;
+    }
+    uint32_t bits = sign | (exponent == 31 ? 0x7f800000 | (mantissa << 13)
+                                           : ((exponent + 127 - 15) << 23) | (mantissa << 13));
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Three 8 bit mantissas sharing the exponent of the brightest channel.
+// Negative channels clamp to zero.
+void encodeRGBE(const Vector3& c, uint8_t* rgbe) {
+    float r = std::max(0.0f, c.x), g = std::max(0.0f, c.y), b = std::max(0.0f, c.z);
+    float brightest = std::max(r, std::max(g, b));
+    if (!(brightest > 1e-32f)) {
+        rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+        return;
+    }
+    int exponent;
+    float scale = std::frexp(brightest, &exponent) * 256.0f / brightest;
+    rgbe[0] = (uint8_t)std::min(255.0f, r * scale);
+    rgbe[1] = (uint8_t)std::min(255.0f, g * scale);
+    rgbe[2] = (uint8_t)std::min(255.0f, b * scale);
+    rgbe[3] = (uint8_t)std::min(255, exponent + 128);
+}
+
+Vector3 decodeRGBE(const uint8_t* rgbe) {
+    if (rgbe[3] == 0) return Vector3(0, 0, 0);
+    float scale = std::ldexp(1.0f, (int)rgbe[3] - (128 + 8));
+    return Vector3((rgbe[0] + 0.5f) * scale, (rgbe[1] + 0.5f) * scale, (rgbe[2] + 0.5f) * scale);
+}
+
+// Finished image kept tile by tile instead of row by row. Each tile owns a
+// block starting on its own cache line, so threads storing neighbouring
+// tiles never write to the same line. Rows come back out once, at the end,
+// through readRows().
+class TiledFramebuffer {
+public:
+    void reset(int width, int height, int tileSize, PixelFormat format);
+    // Takes a tile of the grid, with pixels laid out as TileRect describes
+    void storeTile(const TileRect& rect, const Vector3* pixels);
+    // Decodes rows [y0, y0 + rowCount) into out, row-major
+    void readRows(int y0, int rowCount, Vector3* out) const;
+    
+    PixelFormat format() const { return pixelFormat; }
+    size_t memoryBytes() const { return (size_t)tilesX * tilesY * tileBytes; }
+    
+private:
+    std::unique_ptr<unsigned char[]> block;
+    unsigned char* base = nullptr; // block rounded up to a cache line
+    int width = 0, height = 0, tileSize = 0;
+    int tilesX = 0, tilesY = 0;
+    size_t tileBytes = 0;
+    PixelFormat pixelFormat = PixelFormat::Float;
+    
+    unsigned char* tile(int tx, int ty) const { return base + ((size_t)ty * tilesX + tx) * tileBytes; }
+};
+
+void TiledFramebuffer::reset(int w, int h, int size, PixelFormat format) {
+    width = w;
+    height = h;
+    tileSize = size;
+    pixelFormat = format;
+    tilesX = (width + tileSize - 1) / tileSize;
+    tilesY = (height + tileSize - 1) / tileSize;
+    tileBytes = ((size_t)tileSize * tileSize * pixelFormatBytes(format) + Arena::ALIGN - 1) / Arena::ALIGN * Arena::ALIGN;
+    block.reset(new unsigned char[memoryBytes() + Arena::ALIGN]);
+    base = block.get() + (Arena::ALIGN - (uintptr_t)block.get() % Arena::ALIGN) % Arena::ALIGN;
+}
+
+// Pixels within a tile are row-major with a stride of tileSize, edge tiles included
+void TiledFramebuffer::storeTile(const TileRect& rect, const Vector3* pixels) {
+    assert(rect.x0 % tileSize == 0 && rect.y0 % tileSize == 0);
+    unsigned char* out = tile(rect.x0 / tileSize, rect.y0 / tileSize);
+    const size_t stride = pixelFormatBytes(pixelFormat);
+    for (int y = rect.y0; y < rect.y1; y++) {
+        const Vector3* row = pixels + (size_t)(y - rect.y0) * rect.width();
+        unsigned char* dst = out + (size_t)(y - rect.y0) * tileSize * stride;
+        for (int x = 0; x < rect.width(); x++, dst += stride) {
+            if (pixelFormat == PixelFormat::Float) {
+                memcpy(dst, &row[x], sizeof(Vector3));
+            } else if (pixelFormat == PixelFormat::Half) {
+                uint16_t half[3] = { floatToHalf(row[x].x), floatToHalf(row[x].y), floatToHalf(row[x].z) };
+                memcpy(dst, half, sizeof(half));
+            } else {
+                encodeRGBE(row[x], dst);
+            }
+        }
+    }
+}
+
+void TiledFramebuffer::readRows(int y0, int rowCount, Vector3* out) const {
+    const size_t stride = pixelFormatBytes(pixelFormat);
+    for (int y = y0; y < y0 + rowCount; y++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            const unsigned char* src = tile(tx, y / tileSize) + (size_t)(y % tileSize) * tileSize * stride;
+            int x1 = std::min(width, (tx + 1) * tileSize);
+            for (int x = tx * tileSize; x < x1; x++, src += stride) {
+                Vector3& c = out[(size_t)(y - y0) * width + x];
+                if (pixelFormat == PixelFormat::Float) {
+                    memcpy(&c, src, sizeof(Vector3));
+                } else if (pixelFormat == PixelFormat::Half) {
+                    uint16_t half[3];
+                    memcpy(half, src, sizeof(half));
+                    c = Vector3(halfToFloat(half[0]), halfToFloat(half[1]), halfToFloat(half[2]));
+                } else {
+                    c = decodeRGBE(src);
+                }
+            }
+        }
+    }
+}
+
+struct RenderProgress {
+    std::atomic<uint32_t> tilesDone{0};
+    uint32_t tileCount;
+    uint32_t step;
+    bool report;
+    
+    explicit RenderProgress(uint32_t tiles, bool reportProgress = true)
+        : tileCount(tiles), step(std::max(1u, tiles / 30)), report(reportProgress) {}
+    
+    void tileFinished() {
+        uint32_t finished = tilesDone.fetch_add(1) + 1;
+        if (report && finished % step == 0) {
+            float progress = (finished * 100.0f) / tileCount;
+            std::cerr << "Progress: " << progress << "%\r";
+            std::cerr.flush();
+        }
+    }
+};
+
+enum class RenderMode { Recursive, Wavefront };
+
+struct RenderSettings {
+    RenderMode mode = RenderMode::Recursive;
+    int maxSamples = 1;             // Above 1 switches to progressive adaptive sampling
+    int minSamples = 4;             // First pass, every pixel gets these
+    int samplesPerPass = 4;         // Later passes, only unconverged pixels
+    float varianceThreshold = 0.01f; // Relative standard error at which a pixel stops
+    GBuffer* gbuffer = nullptr;     // Primary hit cache, single sample only
+    ShadingPrecision precision = ShadingPrecision::Precise;
+    bool sortRays = true;           // Wavefront only, bins secondary rays by origin and direction
+    TiledFramebuffer* framebuffer = nullptr; // Takes finished tiles instead of the band when set
+};
+
+int renderTileSize(RenderMode mode) {
+    return mode == RenderMode::Wavefront ? WAVEFRONT_TILE_SIZE : TILE_SIZE;
+}
+
+// Running per-pixel estimate for adaptive sampling. Variance is tracked on luminance.
+struct PixelAccumulator {
+    Vector3 sum;
+    float lumSum = 0;
+    float lumSqSum = 0;
+    uint32_t count = 0;
+    bool converged = false;
+    
+    void add(const Vector3& c) {
+        float lum = 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+        sum = sum + c;
+        lumSum += lum;
+        lumSqSum += lum * lum;
+        count++;
+    }
+    // Standard error of the mean relative to its brightness
+    float relativeError() const {
+        if (count < 2) return FLT_MAX;
+        float mean = lumSum / count;
+        float variance = std::max(0.0f, (lumSqSum - lumSum * mean) / (count - 1));
+        return std::sqrt(variance / count) / std::max(mean, 0.05f);
+    }
+};
+
+inline uint32_t hashPixel(uint32_t x, uint32_t y) {
+    uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u;
+    h ^= h >> 16; h *= 0x7feb352du;
+    h ^= h >> 15; h *= 0x846ca68bu;
+    return h ^ (h >> 16);
+}
+
+// Sample position inside pixel (x, y): an R2 low-discrepancy sequence, shifted
+// per pixel so neighbours don't share a pattern
+void sampleOffset(int x, int y, uint32_t index, float& jx, float& jy) {
+    const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+    uint32_t h = hashPixel(x, y);
+    double ox = (h & 0xffff) / 65536.0, oy = (h >> 16) / 65536.0;
+    jx = (float)std::fmod(ox + a1 * index, 1.0);
+    jy = (float)std::fmod(oy + a2 * index, 1.0);
+}
+
+// Hands a finished tile over: to the framebuffer when the settings have one,
+// otherwise into band, laid out as in renderBand()
+void storeTile(const RenderSettings& settings, const TileRect& rect, const Vector3* pixels,
+               int width, int y0, Vector3* band) {
+    if (settings.framebuffer) {
+        settings.framebuffer->storeTile(rect, pixels);
+        return;
+    }
+    for (int y = rect.y0; y < rect.y1; y++)
+        std::copy_n(pixels + (size_t)(y - rect.y0) * rect.width(), rect.width(), band + (size_t)(y - y0) * width + rect.x0);
+}
+
+// Scratch for one adaptive pass over a tile, in the rendering thread's arena
+struct AdaptiveScratch {
+    ScratchArray<uint32_t> active;   // Tile-local pixel indices still sampling
+    ScratchArray<Vector3> colors;    // One slot per sample of this pass
+    ScratchArray<uint32_t> costs;
+    WavefrontQueues queues;
+    
+    static size_t bytesFor(uint32_t pixels, uint32_t slots, bool wavefront, uint32_t shadowsPerPath) {
+        return Arena::bytesFor<uint32_t>(pixels) + Arena::bytesFor<Vector3>(slots) + Arena::bytesFor<uint32_t>(slots) +
+               (wavefront ? WavefrontQueues::bytesFor(slots, shadowsPerPath) : 0);
+    }
+};
+
+// Renders rows [y0, y1) progressively: every pixel starts with minSamples, then
+// passes of samplesPerPass go only to pixels whose estimate is still noisy, until
+// all of them converge or hit maxSamples. Flat regions stop after the first pass.
+// Accumulators are stored tile by tile, one cache-aligned block per tile, so
+// no two threads ever update the same line.
+void renderBandAdaptive(ThreadPool& pool, const Scene& scene, const Camera& camera, int width, int height,
+                        int y0, int y1, Vector3* band, const RenderProgress& progress,
+                        FrameStats* stats, uint32_t* costs, const RenderSettings& settings) {
+    const int tileSize = renderTileSize(settings.mode);
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (y1 - y0 + tileSize - 1) / tileSize;
+    const int minSamples = std::min(std::max(1, settings.minSamples), settings.maxSamples);
+    
+    const bool wavefront = settings.mode == RenderMode::Wavefront;
+    const bool fast = settings.precision == ShadingPrecision::Fast;
+    const uint32_t tilePixels = tileSize * tileSize;
+    const uint32_t maxSlots = tilePixels * std::max(minSamples, settings.samplesPerPass);
+    const uint32_t shadowsPerPath = std::max(1, scene.shading.shadowRaysPerHit());
+    
+    auto tileRect = [&](uint32_t tile) {
+        TileRect rect;
+        rect.x0 = (tile % tilesX) * tileSize;
+        rect.y0 = y0 + (tile / tilesX) * tileSize;
+        rect.x1 = std::min(rect.x0 + tileSize, width);
+        rect.y1 = std::min(rect.y0 + tileSize, y1);
+        return rect;
+    };
+    
+    // tilePixels is a multiple of 16, so with the 28 byte accumulator every tile's block starts on a cache line
+    const size_t accumCount = (size_t)tilesX * tilesY * tilePixels;
+    Arena accumArena;
+    accumArena.reserve(Arena::bytesFor<PixelAccumulator>(accumCount));
+    PixelAccumulator* accum = accumArena.allocate<PixelAccumulator>(accumCount);
+    std::uninitialized_fill_n(accum, accumCount, PixelAccumulator());
+    pool.reserveArenas(AdaptiveScratch::bytesFor(tilePixels, maxSlots, wavefront, shadowsPerPath));
+    if (costs) std::fill(costs, costs + (size_t)width * (y1 - y0), 0u);
+    
+    for (int pass = 0; ; pass++) {
+        std::atomic<uint32_t> stillActive(0);
+        
+        pool.parallelFor(tilesX * tilesY, [&](uint32_t tile, unsigned thread) {
+            const TileRect rect = tileRect(tile);
+            PixelAccumulator* tileAccum = accum + (size_t)tile * tilePixels;
+            threadStats = RayStats();
+            [[maybe_unused]] uint64_t allocationsBefore = threadAllocations;
+            Arena& arena = pool.arena(thread);
+            arena.reset();
+            AdaptiveScratch s;
+            s.active.allocate(arena, tilePixels);
+            for (uint32_t pixel = 0; pixel < rect.pixelCount(); pixel++) {
+                if (!tileAccum[pixel].converged) s.active.push_back(pixel);
+            }
+            if (s.active.empty()) return;
+            
+            int passSamples = pass == 0 ? minSamples : settings.samplesPerPass;
+            uint32_t slots = s.active.size() * passSamples;
+            s.colors.allocate(arena, slots);
+            s.costs.allocate(arena, slots);
+            s.colors.assign(slots, Vector3(0, 0, 0));
+            s.costs.assign(slots, 0);
+            RT_STAT_ADD(primaryRays, slots);
+            
+            // Trace every sample of the pass, either one by one or as one wavefront
+            WavefrontQueues& q = s.queues;
+            if (wavefront) q.allocate(arena, slots, shadowsPerPath);
+            for (size_t i = 0; i < s.active.size(); i++) {
+                uint32_t pixel = s.active[i];
+                int x = rect.x0 + pixel % rect.width(), y = rect.y0 + pixel / rect.width();
+                for (int k = 0; k < passSamples; k++) {
+                    uint32_t slot = (uint32_t)(i * passSamples + k);
+                    float jx, jy;
+                    sampleOffset(x, y, tileAccum[pixel].count + k, jx, jy);
+                    Ray ray = computePrimRay(x, y, width, height, camera, jx, jy);
+                    if (wavefront) {
+                        q.paths.push_back(PathState{ ray, slot, 1.0f });
+                    } else {
+                        uint64_t costBefore = threadStats.cost();
+                        s.colors[slot] = fast ? trace<ShadingPrecision::Fast>(ray, scene) : trace(ray, scene);
+                        s.costs[slot] = (uint32_t)(threadStats.cost() - costBefore);
+                    }
+                }
+            }
+            if (wavefront && fast)
+                traceWavefront<ShadingPrecision::Fast>(scene, q, s.colors.data(), s.costs.data(), nullptr,
+                                                       settings.sortRays);
+            else if (wavefront)
+                traceWavefront(scene, q, s.colors.data(), s.costs.data(), nullptr, settings.sortRays);
+            
+            uint32_t active = 0;
+            for (size_t i = 0; i < s.active.size(); i++) {
+                uint32_t pixel = s.active[i];
+                PixelAccumulator& acc = tileAccum[pixel];
+                uint32_t* cost = costs ? costs + rect.imageIndex(pixel, width) - (size_t)y0 * width : nullptr;
+                for (int k = 0; k < passSamples; k++) {
+                    acc.add(s.colors[i * passSamples + k]);
+                    if (cost) *cost += s.costs[i * passSamples + k];
+                }
+                acc.converged = (int)acc.count >= settings.maxSamples ||
+                                acc.relativeError() < settings.varianceThreshold;
+                if (!acc.converged) active++;
+            }
+            stillActive += active;
+            RT_STAT_ADD(allocations, threadAllocations - allocationsBefore);
+            if (stats) stats->perThread[thread].merge(threadStats);
+        });
+        
+        if (progress.report) {
+            std::cerr << "Pass " << pass + 1 << ": " << stillActive.load() << " pixels still sampling\r";
+            std::cerr.flush();
+        }
+        if (stillActive == 0) break;
+    }
+    
+    // Resolves each tile once, into the band or the framebuffer
+    pool.parallelFor(tilesX * tilesY, [&](uint32_t tile, unsigned thread) {
+        const TileRect rect = tileRect(tile);
+        const PixelAccumulator* tileAccum = accum + (size_t)tile * tilePixels;
+        Arena& arena = pool.arena(thread);
+        arena.reset();
+        Vector3* pixels = arena.allocate<Vector3>(rect.pixelCount());
+        for (uint32_t i = 0; i < rect.pixelCount(); i++)
+            pixels[i] = tileAccum[i].sum * (1.0f / std::max(1u, tileAccum[i].count));
+        storeTile(settings, rect, pixels, width, y0, band);
+    });
+}
+
+// Renders the pixels of one tile one by one into pixels (and costs), both tile-local
+void renderTileRecursive(const Scene& scene, const Camera& camera, int width, int height, const TileRect& rect,
+                         Vector3* pixels, uint32_t* costs, GBuffer* gbuffer, bool fast) {
+    uint32_t pixel = 0;
+    for (int y = rect.y0; y < rect.y1; y++) {
+        for (int x = rect.x0; x < rect.x1; x++, pixel++) {
+            uint64_t costBefore = threadStats.cost();
+            Ray ray = computePrimRay(x, y, width, height, camera);
+            RT_STAT_ADD(primaryRays, 1);
+            HitRecord hit;
+            if (gbuffer && gbuffer->valid) {
+                hit = gbuffer->primaryHit(scene, ray, (size_t)y * width + x);
+            } else {
+                scene.intersect(ray, hit);
+                if (gbuffer) gbuffer->store(scene, (size_t)y * width + x, hit);
+            }
+            pixels[pixel] = fast ? traceHit<ShadingPrecision::Fast>(ray, scene, hit, 0) : traceHit(ray, scene, hit, 0);
+            if (costs) costs[pixel] = (uint32_t)(threadStats.cost() - costBefore);
+        }
+    }
+}
+
+// Renders rows [y0, y1) as tiles on the pool. band holds just those rows, so
+// pixel (x, y) lands at band[(y - y0) * width + x]; with a framebuffer in the
+// settings tiles go there instead and band may be null. When given, stats
+// collects the ray counters and costs (laid out like band) the per-pixel
+// traversal cost. Each tile renders into its thread's arena and is copied out once.
+void renderBand(ThreadPool& pool, const Scene& scene, const Camera& camera, int width, int height,
+                int y0, int y1, Vector3* band, RenderProgress& progress,
+                FrameStats* stats = nullptr, uint32_t* costs = nullptr,
+                const RenderSettings& settings = RenderSettings()) {
+    if (settings.maxSamples > 1) {
+        renderBandAdaptive(pool, scene, camera, width, height, y0, y1, band, progress, stats, costs, settings);
+        return;
+    }
+    
+    // Tiles let idle threads steal cheap background work from busy ones. Wavefront
+    // tiles are bigger so each stage gets a decent batch of rays.
+    const RenderMode mode = settings.mode;
+    const int tileSize = renderTileSize(mode);
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (y1 - y0 + tileSize - 1) / tileSize;
+    const uint32_t tilePixels = tileSize * tileSize;
+    const uint32_t shadowsPerPath = std::max(1, scene.shading.shadowRaysPerHit());
+    size_t arenaBytes = Arena::bytesFor<Vector3>(tilePixels) + Arena::bytesFor<uint32_t>(tilePixels);
+    if (mode == RenderMode::Wavefront) arenaBytes += WavefrontQueues::bytesFor(tilePixels, shadowsPerPath);
+    pool.reserveArenas(arenaBytes);
+    GBuffer* gbuffer = settings.gbuffer;
+    const bool fast = settings.precision == ShadingPrecision::Fast;
+    
+    pool.parallelFor(tilesX * tilesY, [&](uint32_t tile, unsigned thread) {
+        TileRect rect;
+        rect.x0 = (tile % tilesX) * tileSize;
+        rect.y0 = y0 + (tile / tilesX) * tileSize;
+        rect.x1 = std::min(rect.x0 + tileSize, width);
+        rect.y1 = std::min(rect.y0 + tileSize, y1);
+        
+        threadStats = RayStats();
+        [[maybe_unused]] uint64_t allocationsBefore = threadAllocations;
+        Arena& arena = pool.arena(thread);
+        arena.reset();
+        Vector3* pixels = arena.allocate<Vector3>(rect.pixelCount());
+        uint32_t* tileCosts = costs ? arena.allocate<uint32_t>(rect.pixelCount()) : nullptr;
+        if (mode == RenderMode::Wavefront) {
+            WavefrontQueues q;
+            q.allocate(arena, rect.pixelCount(), shadowsPerPath);
+            renderTileWavefront(scene, camera, width, height, rect, pixels, tileCosts, q, gbuffer,
+                                settings.precision, settings.sortRays);
+        } else {
+            renderTileRecursive(scene, camera, width, height, rect, pixels, tileCosts, gbuffer, fast);
+        }
+        storeTile(settings, rect, pixels, width, y0, band);
+        if (costs) {
+            for (int y = rect.y0; y < rect.y1; y++)
+                std::copy_n(tileCosts + (size_t)(y - rect.y0) * rect.width(), rect.width(),
+                            costs + (size_t)(y - y0) * width + rect.x0);
+        }
+        RT_STAT_ADD(allocations, threadAllocations - allocationsBefore);
+        if (stats) stats->perThread[thread].merge(threadStats);
+        progress.tileFinished();
+    });
+}
+
+
+// Interactive preview. Each render() call works for at most its time budget and
+// then returns whatever it has, picking up where it stopped on the next call:
+// first every 8th pixel filled out as 8x8 blocks, then every 4th, 2nd and every
+// pixel, then further jittered samples up to maxSamples. Moving the camera starts
+// over from the coarsest level. cancel() from any thread ends the call in
+// progress after the tiles already being traced. It stays pending until a call
+// returns with Progress::cancelled, so one that lands between calls ends the
+// next call right away instead of being lost.
+class Renderer {
+public:
+    struct Progress {
+        int stride = 0;         // Pixels per block side of the level being refined, 1 once at full resolution
+        uint32_t samples = 0;   // Samples per pixel finished at full resolution
+        bool finished = false;  // Nothing left to refine for this camera
+        bool cancelled = false;
+    };
+    
+    Renderer(ThreadPool& pool, int width, int height, int maxSamples = 1,
+             ShadingPrecision precision = ShadingPrecision::Precise);
+    
+    Progress render(const Scene& scene, const Camera& camera, double budgetMs);
+    void cancel() { cancelled = true; }
+    // Drops the refinement so far, for when the scene changes under the same camera
+    void reset();
+    
+    // Row-major, width * height, the current estimate of every pixel
+    const std::vector<Vector3>& image() const { return pixels; }
+    
+private:
+    static const int COARSEST_STRIDE = 8; // Divides TILE_SIZE, so blocks never cross tiles
+    
+    ThreadPool& pool;
+    int width, height;
+    int maxSamples;
+    ShadingPrecision precision;
+    int tilesX, tilesY;
+    std::vector<Vector3> pixels;
+    std::vector<Vector3> sums;         // Per pixel, once sampling at full resolution
+    std::vector<uint8_t> tileDone;     // Per tile, for the pass in progress
+    int pass = 0;                      // 0..3 halve the stride, from 4 on each adds a sample
+    Camera lastCamera;
+    bool hasCamera = false;
+    std::atomic<bool> cancelled{false};
+    
+    int stride() const { return std::max(1, COARSEST_STRIDE >> pass); }
+    uint32_t passSample() const { return (uint32_t)std::max(0, pass - 3); } // Sample index of a full resolution pass
+    bool finished() const { return (int)passSample() >= std::max(1, maxSamples); }
+    void renderTile(const Scene& scene, const Camera& camera, uint32_t tile);
+};
+
+Renderer::Renderer(ThreadPool& p, int w, int h, int samples, ShadingPrecision shading)
+    : pool(p), width(w), height(h), maxSamples(samples), precision(shading),
+      tilesX((w + TILE_SIZE - 1) / TILE_SIZE), tilesY((h + TILE_SIZE - 1) / TILE_SIZE),
+      pixels((size_t)w * h), sums((size_t)w * h), tileDone((size_t)tilesX * tilesY) {}
+
+void Renderer::reset() {
+    pass = 0;
+    hasCamera = false;
+    std::fill(tileDone.begin(), tileDone.end(), 0);
+}
+
+inline bool sameCamera(const Camera& a, const Camera& b) {
+    auto same = [](const Vector3& u, const Vector3& v) { return u.x == v.x && u.y == v.y && u.z == v.z; };
+    return same(a.position, b.position) && same(a.forward, b.forward) && same(a.right, b.right) && same(a.up, b.up);
+}
+
+// Traces the tile's pixels for the current pass. Below full resolution a pixel
+// whose block the previous level already traced only refills its smaller block.
+void Renderer::renderTile(const Scene& scene, const Camera& camera, uint32_t tile) {
+    const int x0 = (tile % tilesX) * TILE_SIZE, y0 = (tile / tilesX) * TILE_SIZE;
+    const int x1 = std::min(x0 + TILE_SIZE, width), y1 = std::min(y0 + TILE_SIZE, height);
+    const int step = stride();
+    const uint32_t sample = passSample();
+    const bool fast = precision == ShadingPrecision::Fast;
+    for (int y = y0; y < y1; y += step) {
+        for (int x = x0; x < x1; x += step) {
+            size_t pixel = (size_t)y * width + x;
+            bool traced = pass > 0 && pass <= 3 && x % (2 * step) == 0 && y % (2 * step) == 0;
+            Vector3 color = pixels[pixel];
+            if (!traced) {
+                float jx = 0.5f, jy = 0.5f;
+                if (sample > 0) sampleOffset(x, y, sample, jx, jy);
+                Ray ray = computePrimRay(x, y, width, height, camera, jx, jy);
+                color = fast ? trace<ShadingPrecision::Fast>(ray, scene) : trace(ray, scene);
+            }
+            if (step == 1) {
+                // The first full resolution pass starts the sums, later ones add to them
+                sums[pixel] = sample == 0 ? color : sums[pixel] + color;
+                pixels[pixel] = sums[pixel] * (1.0f / (sample + 1));
+                continue;
+            }
+            int bx1 = std::min(x + step, x1), by1 = std::min(y + step, y1);
+            for (int by = y; by < by1; by++)
+                std::fill(pixels.begin() + (size_t)by * width + x, pixels.begin() + (size_t)by * width + bx1, color);
+        }
+    }
+}
+
+Renderer::Progress Renderer::render(const Scene& scene, const Camera& camera, double budgetMs) {
+    using Clock = std::chrono::steady_clock;
+    const Clock::time_point deadline = Clock::now() + std::chrono::microseconds((int64_t)(budgetMs * 1000));
+    if (!hasCamera || !sameCamera(camera, lastCamera)) {
+        reset();
+        lastCamera = camera;
+        hasCamera = true;
+    }
+    
+    std::vector<uint32_t> pending;
+    while (!finished()) {
+        pending.clear();
+        for (uint32_t tile = 0; tile < tileDone.size(); tile++) {
+            if (!tileDone[tile]) pending.push_back(tile);
+        }
+        // Tiles past the deadline are left for the next call
+        pool.parallelFor((uint32_t)pending.size(), [&](uint32_t i, unsigned) {
+            if (cancelled || Clock::now() >= deadline) return;
+            renderTile(scene, camera, pending[i]);
+            tileDone[pending[i]] = 1;
+        });
+        if (std::find(tileDone.begin(), tileDone.end(), 0) != tileDone.end()) break;
+        pass++;
+        std::fill(tileDone.begin(), tileDone.end(), 0);
+        if (cancelled || Clock::now() >= deadline) break;
+    }
+    
+    Progress progress;
+    progress.stride = stride();
+    progress.samples = pass > 3 ? passSample() : 0;
+    progress.finished = finished();
+    progress.cancelled = cancelled.exchange(false); // The caller sees it, so it is handled
+    return progress;
+}
+
+enum class ImageFormat { P3, P6 };
+
+// Writes a PPM image in blocks of rows, to a file or to stdout when the path is "-".
+// Rows are encoded into one byte buffer per block and written in a single call.
+class PPMWriter {
+public:
+    bool open(const std::string& path, int width, int height, ImageFormat format = ImageFormat::P6);
+    void writeRows(const Vector3* pixels, int rowCount);
+    bool close();
+    
+private:
+    std::ofstream file;
+    std::ostream* out = nullptr;
+    std::vector<char> buffer;
+    int width = 0;
+    ImageFormat format = ImageFormat::P6;
+};
+
+inline uint8_t toByte(float c) {
+    return (uint8_t)std::min(255, std::max(0, (int)(255 * c)));
+}
+
+bool PPMWriter::open(const std::string& path, int w, int h, ImageFormat fmt) {
+    width = w;
+    format = fmt;
+    if (path == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        out = &std::cout;
+    } else {
+        file.open(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "Error opening output file: " << path << "\n";
+            return false;
+        }
+        out = &file;
+    }
+    *out << (format == ImageFormat::P6 ? "P6" : "P3") << "\n" << width << " " << h << "\n255\n";
+    return true;
+}
+
+void PPMWriter::writeRows(const Vector3* pixels, int rowCount) {
+    size_t count = (size_t)width * rowCount;
+    if (format == ImageFormat::P6) {
+        buffer.resize(count * 3);
+        for (size_t i = 0; i < count; i++) {
+            buffer[i * 3 + 0] = (char)toByte(pixels[i].x);
+            buffer[i * 3 + 1] = (char)toByte(pixels[i].y);
+            buffer[i * 3 + 2] = (char)toByte(pixels[i].z);
+        }
+    } else {
+        // "255 255 255\n" is the longest a pixel gets
+        buffer.resize(count * 12);
+        char* p = buffer.data();
+        for (size_t i = 0; i < count; i++) {
+            p = std::to_chars(p, p + 3, toByte(pixels[i].x)).ptr; *p++ = ' ';
+            p = std::to_chars(p, p + 3, toByte(pixels[i].y)).ptr; *p++ = ' ';
+            p = std::to_chars(p, p + 3, toByte(pixels[i].z)).ptr; *p++ = '\n';
+        }
+        buffer.resize(p - buffer.data());
+    }
+    out->write(buffer.data(), buffer.size());
+}
+
+bool PPMWriter::close() {
+    out->flush();
+    bool ok = !out->fail();
+    if (file.is_open()) file.close();
+    return ok;
+}
+
+// Writes per-pixel traversal cost as a blue-to-red false color image, scaled to
+// the most expensive pixel
+bool writeHeatmap(const std::string& path, const std::vector<uint32_t>& costs, int width, int height) {
+    uint32_t maxCost = 1;
+    for (uint32_t c : costs) maxCost = std::max(maxCost, c);
+    
+    std::vector<Vector3> row(width);
+    PPMWriter writer;
+    if (!writer.open(path, width, height)) return false;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float t = costs[(size_t)y * width + x] / (float)maxCost;
+            row[x] = Vector3(std::min(1.0f, 2 * t), 1 - std::fabs(2 * t - 1), std::max(0.0f, 1 - 2 * t));
+        }
+        writer.writeRows(row.data(), 1);
+    }
+    std::cerr << "Saved heatmap " << path << " (max " << maxCost << " tests per pixel)\n";
+    return writer.close();
+}
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+    
+    bool open(const std::string& path);
+    void close();
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+    
+private:
+    const char* ptr = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string& path) {
+    close();
+    fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize)) { close(); return false; }
+    length = (size_t)fileSize.QuadPart;
+    if (length == 0) return true;
+    mapping = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) { close(); return false; }
+    ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr) { close(); return false; }
+    return true;
+}
+
+void MappedFile::close() {
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle(mapping);
+    if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+    ptr = nullptr;
+    mapping = nullptr;
+    fileHandle = INVALID_HANDLE_VALUE;
+    length = 0;
+}
+#else
+bool MappedFile::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+    length = (size_t)st.st_size;
+    if (length > 0) {
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) { ::close(fd); length = 0; return false; }
+        madvise(mapped, length, MADV_SEQUENTIAL);
+        ptr = (const char*)mapped;
+    }
+    ::close(fd);
+    return true;
+}
+
+void MappedFile::close() {
+    if (ptr) munmap((void*)ptr, length);
+    ptr = nullptr;
+    length = 0;
+}
+#endif
+
+// Line-oriented scanning helpers for the OBJ parser - all work in place on the mapping
+inline const char* skipSpaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    return p;
+}
+
+inline const char* skipToken(const char* p, const char* end) {
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+    return p;
+}
+
+inline const char* lineEnd(const char* p, const char* end) {
+    const char* nl = (const char*)std::memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+inline bool startsWithKeyword(const char* p, const char* end, const char* keyword, size_t length) {
+    return (size_t)(end - p) > length && std::memcmp(p, keyword, length) == 0 && (p[length] == ' ' || p[length] == '\t');
+}
+
+// Returns 'v' or 'f' for vertex and face lines, 'u' for usemtl and 'm' for
+// mtllib, 0 for anything else
+inline char objLineType(const char* p, const char* end) {
+    if (end - p < 2) return 0;
+    if (p[1] == ' ' || p[1] == '\t') return (p[0] == 'v' || p[0] == 'f') ? p[0] : 0;
+    if (startsWithKeyword(p, end, "usemtl", 6)) return 'u';
+    if (startsWithKeyword(p, end, "mtllib", 6)) return 'm';
+    return 0;
+}
+
+// The rest of a keyword line, without the trailing \r or spaces
+inline std::string_view objLineArgument(const char* p, const char* eol) {
+    p = skipSpaces(skipToken(p, eol), eol);
+    while (eol > p && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t')) eol--;
+    return std::string_view(p, eol - p);
+}
+
+// A line-aligned slice of the file plus where its vertices and faces land in the output
+struct ObjChunk {
+    const char* begin;
+    const char* end;
+    uint32_t vertexCount = 0, faceCount = 0;
+    uint32_t vertexBase = 0, faceBase = 0;
+    std::string_view lastMaterial;  // Last usemtl name in the chunk, if any
+    uint16_t startMaterial = 0;     // Material in effect where the chunk starts
+};
+
+// usemtl names to material offsets. Offset 0 is the mesh's own material, which
+// faces before any usemtl and faces naming an unknown material keep.
+typedef std::map<std::string, uint16_t, std::less<>> ObjMaterialNames;
+
+inline uint16_t objMaterialOffset(const ObjMaterialNames& names, std::string_view name) {
+    auto found = names.find(name);
+    return found != names.end() ? found->second : 0;
+}
+
+// Paths of the MTL files the OBJ pulls in with mtllib, relative to the OBJ's directory
+std::vector<std::string> objMaterialLibraries(const std::string& objPath, const char* begin, const char* end) {
+    std::vector<std::string> libraries;
+    std::string directory = objPath.substr(0, objPath.find_last_of("/\\") + 1);
+    for (const char* p = begin; p < end; ) {
+        const char* eol = lineEnd(p, end);
+        const char* q = skipSpaces(p, eol);
+        if (objLineType(q, eol) == 'm') {
+            std::istringstream names(std::string(objLineArgument(q, eol)));
+            std::string name;
+            while (names >> name) libraries.push_back(directory + name);
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    return libraries;
+}
+
+std::vector<std::string> objMaterialLibraries(const std::string& objPath) {
+    MappedFile file;
+    if (!file.open(objPath)) return {};
+    return objMaterialLibraries(objPath, file.data(), file.data() + file.size());
+}
+
+// Appends the newmtl blocks of an MTL file. Kd gives the color and Ns the specular
+// exponent. Reflections follow the illumination model: illum 3 and up (the ray
+// traced reflection modes) reflect by the mean of Ks, the rest not at all.
+bool loadMTL(const std::string& path, std::vector<std::pair<std::string, Material>>& materials) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Error opening MTL file: " << path << "\n";
+        return false;
+    }
+    
+    Vector3 specular(0.5f, 0.5f, 0.5f);
+    int illum = 2;
+    auto finish = [&]() {
+        if (materials.empty()) return;
+        materials.back().second.reflectivity = illum >= 3 ? (specular.x + specular.y + specular.z) / 3 : 0.0f;
+    };
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream in(line.substr(0, line.find('#')));
+        std::string key;
+        if (!(in >> key)) continue;
+        if (key == "newmtl") {
+            finish();
+            std::string name;
+            in >> name;
+            materials.push_back({ name, Material{ Vector3(0.8f, 0.8f, 0.8f) } });
+            specular = Vector3(0.5f, 0.5f, 0.5f);
+            illum = 2;
+        }
+        else if (materials.empty()) continue;
+        else if (key == "Kd") in >> materials.back().second.color.x >> materials.back().second.color.y >> materials.back().second.color.z;
+        else if (key == "Ks") in >> specular.x >> specular.y >> specular.z;
+        else if (key == "Ns") {
+            float exponent;
+            if (in >> exponent) materials.back().second.specularExponent = std::max(1.0f, exponent);
+        }
+        else if (key == "illum") in >> illum;
+    }
+    finish();
+    return true;
+}
+
+const int32_t INVALID_INDEX = -1;
+const size_t OBJ_PARALLEL_MIN_BYTES = 1 << 20;
+
+void countObjChunk(ObjChunk& chunk) {
+    for (const char* p = chunk.begin; p < chunk.end; ) {
+        const char* eol = lineEnd(p, chunk.end);
+        const char* q = skipSpaces(p, eol);
+        char type = objLineType(q, eol);
+        if (type == 'v') chunk.vertexCount++;
+        else if (type == 'f') chunk.faceCount++;
+        else if (type == 'u') chunk.lastMaterial = objLineArgument(q, eol);
+        p = eol < chunk.end ? eol + 1 : chunk.end;
+    }
+}
+
+// Parses vertices and face index triples straight out of the mapping. Indices are
+// resolved against the vertices defined so far, as the OBJ format specifies; a face
+// that references an undefined vertex gets INVALID_INDEX. Each face's material
+// offset goes to faceMaterials.
+void parseObjChunk(const ObjChunk& chunk, float scale, Vector3 offset, const ObjMaterialNames& materialNames,
+                   Vector3* vertices, int32_t* faces, uint16_t* faceMaterials) {
+    uint32_t vertexCount = chunk.vertexBase;
+    uint32_t faceCount = 0;
+    uint16_t material = chunk.startMaterial;
+    
+    for (const char* p = chunk.begin; p < chunk.end; ) {
+        const char* eol = lineEnd(p, chunk.end);
+        const char* q = skipSpaces(p, eol);
+        char type = objLineType(q, eol);
+        
+        if (type == 'v') {
+            q += 2;
+            float xyz[3] = { 0, 0, 0 };
+            for (int i = 0; i < 3; i++) {
+                q = skipSpaces(q, eol);
+                auto result = std::from_chars(q, eol, xyz[i]);
+                if (result.ec != std::errc()) break;
+                q = result.ptr;
+            }
+            vertices[vertexCount++ - chunk.vertexBase] = Vector3(xyz[0], xyz[1], xyz[2]) * scale + offset;
+        }
+        else if (type == 'u') {
+            material = objMaterialOffset(materialNames, objLineArgument(q, eol));
+        }
+        else if (type == 'f') {
+            q += 2;
+            faceMaterials[faceCount] = material;
+            int32_t* face = faces + 3 * faceCount++;
+            for (int i = 0; i < 3; i++) {
+                q = skipSpaces(q, eol);
+                long long index = 0;
+                auto result = std::from_chars(q, eol, index);
+                if (result.ec != std::errc()) index = 0;
+                q = skipToken(q, eol); // Drops any /vt/vn part
+                
+                if (index < 0) index += vertexCount; // Relative to the last vertex
+                else index -= 1;
+                face[i] = (index >= 0 && index < vertexCount) ? (int32_t)index : INVALID_INDEX;
+            }
+        }
+        p = eol < chunk.end ? eol + 1 : chunk.end;
+    }
+}
+
+// Memory-maps the file and parses it in place. A counting pre-pass sizes the
+// output exactly; files over OBJ_PARALLEL_MIN_BYTES are split into line-aligned
+// chunks that are parsed in parallel on the pool. Scale and offset are baked
+// into the shared vertices, once per vertex.
+//
+// With a material table, the file's mtllib materials are appended to it and
+// usemtl picks them per face. The mesh then starts on a copy of material followed
+// by the library, so triangleMaterials can be offsets from mesh.material.
+Mesh loadOBJ(const std::string& path, uint32_t material, float scale = 1.0f, 
+             Vector3 offset = Vector3(0,0,0), bool doubleSided = false, ThreadPool* pool = nullptr,
+             std::vector<Material>* materials = nullptr) {
+    Mesh mesh;
+    mesh.material = material;
+    mesh.doubleSided = doubleSided;
+    
+    MappedFile file;
+    if (!file.open(path)) {
+        std::cerr << "Error opening OBJ file: " << path << "\n";
+        return mesh;
+    }
+    
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+    size_t chunkCount = 1;
+    if (pool && file.size() >= OBJ_PARALLEL_MIN_BYTES) chunkCount = pool->size() * 4;
+    
+    std::vector<ObjChunk> chunks;
+    const char* chunkStart = begin;
+    for (size_t i = 1; i <= chunkCount && chunkStart < end; i++) {
+        const char* chunkEnd = (i == chunkCount) ? end : begin + file.size() * i / chunkCount;
+        if (chunkEnd < chunkStart) chunkEnd = chunkStart;
+        chunkEnd = lineEnd(chunkEnd, end);
+        if (chunkEnd < end) chunkEnd++;
+        ObjChunk chunk;
+        chunk.begin = chunkStart;
+        chunk.end = chunkEnd;
+        chunks.push_back(chunk);
+        chunkStart = chunkEnd;
+    }
+    
+    auto forEachChunk = [&](const std::function<void(uint32_t, unsigned)>& fn) {
+        if (pool && chunks.size() > 1) pool->parallelFor((uint32_t)chunks.size(), fn);
+        else for (uint32_t i = 0; i < chunks.size(); i++) fn(i, 0);
+    };
+    
+    forEachChunk([&](uint32_t i, unsigned) { countObjChunk(chunks[i]); });
+    
+    // Offsets 1.. are the library materials in file order
+    std::vector<std::pair<std::string, Material>> library;
+    if (materials) {
+        for (const std::string& libraryPath : objMaterialLibraries(path, begin, end)) loadMTL(libraryPath, library);
+    }
+    ObjMaterialNames materialNames;
+    for (size_t i = 0; i < library.size() && i < UINT16_MAX; i++) materialNames.emplace(library[i].first, (uint16_t)(i + 1));
+    
+    uint32_t vertexTotal = 0, faceTotal = 0;
+    uint16_t currentMaterial = 0;
+    for (auto& chunk : chunks) {
+        chunk.vertexBase = vertexTotal;
+        chunk.faceBase = faceTotal;
+        chunk.startMaterial = currentMaterial;
+        if (!chunk.lastMaterial.empty()) currentMaterial = objMaterialOffset(materialNames, chunk.lastMaterial);
+        vertexTotal += chunk.vertexCount;
+        faceTotal += chunk.faceCount;
+    }
+    
+    mesh.vertices.resize(vertexTotal);
+    std::vector<int32_t> faces(faceTotal * 3);
+    std::vector<uint16_t> faceMaterials(faceTotal);
+    forEachChunk([&](uint32_t i, unsigned) {
+        parseObjChunk(chunks[i], scale, offset, materialNames, mesh.vertices.data() + chunks[i].vertexBase,
+                      faces.data() + 3 * chunks[i].faceBase, faceMaterials.data() + chunks[i].faceBase);
+    });
+    
+    // Drop faces with bad indices while copying into the index buffer
+    bool usesLibrary = std::any_of(faceMaterials.begin(), faceMaterials.end(), [](uint16_t m) { return m != 0; });
+    mesh.indices.reserve(faces.size());
+    if (usesLibrary) mesh.triangleMaterials.reserve(faceTotal);
+    for (uint32_t f = 0; f < faceTotal; f++) {
+        const int32_t* face = &faces[f * 3];
+        if (face[0] == INVALID_INDEX || face[1] == INVALID_INDEX || face[2] == INVALID_INDEX) continue;
+        mesh.indices.insert(mesh.indices.end(), face, face + 3);
+        if (usesLibrary) mesh.triangleMaterials.push_back(faceMaterials[f]);
+    }
+    if (usesLibrary) {
+        mesh.material = (uint32_t)materials->size();
+        mesh.materialCount = (uint32_t)std::min<size_t>(library.size(), UINT16_MAX) + 1;
+        materials->push_back((*materials)[material]);
+        for (size_t i = 0; i + 1 < mesh.materialCount; i++) materials->push_back(library[i].second);
+    }
+    
+    std::cerr << "Loaded " << mesh.triangleCount() << " triangles (" << mesh.vertices.size()
+              << " vertices";
+    if (usesLibrary) std::cerr << ", " << mesh.materialCount - 1 << " materials";
+    std::cerr << ") from " << path << "\n";
+    return mesh;
+}
+
+// Binary cache of the loaded OBJ meshes plus the BVH of the scene built around
+// them, so later runs skip both the parse and the build. The file is a header,
+// a table of meshes and then 64-byte aligned sections found by offset, so the
+// whole thing is read through a single mapping with no pointers to fix up. Each
+// mesh is keyed by the OBJ file's path, size and modification time plus its load
+// parameters (objKey()), and also checked against the same stamps of the MTL
+// files it pulled in. The BVH is keyed by those mesh keys, the rest of the scene
+// geometry, the layout and the builder (sceneKey()). None of the keys reads the
+// files' contents, so a hit costs a few stat() calls, and any part can be stale
+// on its own.
+class SceneCache {
+public:
+    // What a cached mesh was loaded from: its objKey() and the MTL files it pulled in
+    struct MeshSource {
+        uint64_t key = 0;
+        std::vector<std::string> libraries;
+    };
+    
+    bool open(const std::string& path);
+    void close() { file.close(); header = nullptr; }
+    // Library materials the mesh comes with are appended to materials, as loadOBJ()
+    // does, and the MTL files they came from to libraries
+    bool loadMesh(uint64_t key, Mesh& mesh, std::vector<Material>& materials,
+                  std::vector<std::string>& libraries) const;
+    bool loadBVH(uint64_t key, Scene& scene, TriangleLayout layout) const;
+    // The first sources.size() meshes of the scene are the cached ones
+    static bool save(const std::string& path, const std::vector<MeshSource>& sources,
+                     uint64_t bvhKey, const Scene& scene);
+    
+private:
+    enum Section {
+        Nodes, Prims,
+        TriV0x, TriV0y, TriV0z, TriE1x, TriE1y, TriE1z, TriE2x, TriE2y, TriE2z, TriNx, TriNy, TriNz,
+        TriDoubleSided, SectionCount
+    };
+    struct Header {
+        uint32_t magic, version;
+        uint64_t bvhKey;
+        uint32_t layout;
+        uint32_t meshCount;
+        uint64_t triangleCount; // TriangleSoA::count, 0 for the Indexed layout
+        uint64_t offset[SectionCount], bytes[SectionCount];
+    };
+    struct MeshEntry {
+        uint64_t key;
+        uint32_t doubleSided, padding;
+        uint64_t vertexOffset, vertexBytes;
+        uint64_t indexOffset, indexBytes;
+        uint64_t materialOffset, materialBytes;          // The library materials, after the mesh's own
+        uint64_t triangleMaterialOffset, triangleMaterialBytes;
+        uint64_t libraryKey;                             // libraryKey() of the MTL files when saved
+        uint64_t libraryOffset, libraryBytes;            // Their paths, one per line
+    };
+    
+    template <typename T>
+    bool readBytes(uint64_t offset, uint64_t bytes, std::vector<T>& out) const;
+    const MeshEntry* meshTable() const { return (const MeshEntry*)(file.data() + sizeof(Header)); }
+    
+    MappedFile file;
+    const Header* header = nullptr;
+};
+
+const uint32_t SCENE_CACHE_MAGIC = 0x43535452; // "RTSC"
+const uint32_t SCENE_CACHE_VERSION = 4;
+const uint64_t SCENE_CACHE_ALIGN = 64;
+
+// Hashes a file's path, size and modification time, which change whenever it is
+// rewritten. False if the file cannot be found.
+bool hashFileStamp(uint64_t& h, const std::string& path) {
+    std::error_code error;
+    uint64_t size = std::filesystem::file_size(path, error);
+    if (error) return false;
+    int64_t modified = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+    if (error) return false;
+    h = hashBytes(h, path.data(), path.size());
+    h = hashBytes(h, &size, sizeof(size));
+    h = hashBytes(h, &modified, sizeof(modified));
+    return true;
+}
+
+// Stamp of the OBJ file plus everything loadOBJ() bakes into the vertices, 0 if
+// the file is missing
+uint64_t objKey(const std::string& path, float scale, Vector3 offset, bool doubleSided) {
+    uint64_t h = HASH_SEED;
+    if (!hashFileStamp(h, path)) return 0;
+    h = hashBytes(h, &scale, sizeof(scale));
+    h = hashBytes(h, &offset, sizeof(offset));
+    return hashBytes(h, &doubleSided, sizeof(doubleSided));
+}
+
+// Stamps of the MTL files a mesh pulled in. Missing ones count too, so an MTL
+// file showing up later invalidates the mesh.
+uint64_t libraryKey(const std::vector<std::string>& libraries) {
+    uint64_t h = HASH_SEED;
+    for (const std::string& library : libraries) {
+        if (!hashFileStamp(h, library)) h = hashBytes(h, library.data(), library.size());
+    }
+    return h;
+}
+
+// Key of the BVH: the cached meshes by their keys, the rest of the geometry (the
+// room) by its contents, and how the tree is built
+uint64_t sceneKey(const std::vector<SceneCache::MeshSource>& sources, const Scene& scene, TriangleLayout layout,
+                  BVHBuilder builder) {
+    uint32_t width = layout == TriangleLayout::Precomputed ? leafKernels.width : 1;
+    uint64_t h = hashBytes(HASH_SEED, &layout, sizeof(layout));
+    h = hashBytes(h, &builder, sizeof(builder));
+    h = hashBytes(h, &width, sizeof(width));
+    for (const SceneCache::MeshSource& source : sources) h = hashBytes(h, &source.key, sizeof(source.key));
+    for (size_t m = sources.size(); m < scene.meshes.size(); m++) h = hashMesh(h, scene.meshes[m]);
+    return h;
+}
+
+bool SceneCache::open(const std::string& path) {
+    close();
+    if (!file.open(path)) return false;
+    
+    const Header* h = (const Header*)file.data();
+    if (file.size() < sizeof(Header) || h->magic != SCENE_CACHE_MAGIC || h->version != SCENE_CACHE_VERSION) {
+        std::cerr << "Ignoring unreadable scene cache " << path << "\n";
+        file.close();
+        return false;
+    }
+    
+    bool inBounds = file.size() >= sizeof(Header) + (uint64_t)h->meshCount * sizeof(MeshEntry);
+    auto check = [&](uint64_t offset, uint64_t bytes) {
+        inBounds = inBounds && offset <= file.size() && bytes <= file.size() - offset;
+    };
+    for (int i = 0; i < SectionCount; i++) check(h->offset[i], h->bytes[i]);
+    const MeshEntry* meshes = (const MeshEntry*)(file.data() + sizeof(Header));
+    for (uint32_t i = 0; inBounds && i < h->meshCount; i++) {
+        check(meshes[i].vertexOffset, meshes[i].vertexBytes);
+        check(meshes[i].indexOffset, meshes[i].indexBytes);
+        check(meshes[i].materialOffset, meshes[i].materialBytes);
+        check(meshes[i].triangleMaterialOffset, meshes[i].triangleMaterialBytes);
+        check(meshes[i].libraryOffset, meshes[i].libraryBytes);
+    }
+    if (!inBounds) {
+        std::cerr << "Ignoring truncated scene cache " << path << "\n";
+        file.close();
+        return false;
+    }
+    header = h;
+    return true;
+}
+
+template <typename T>
+bool SceneCache::readBytes(uint64_t offset, uint64_t bytes, std::vector<T>& out) const {
+    if (bytes % sizeof(T) != 0) return false;
+    out.resize(bytes / sizeof(T));
+    if (bytes == 0) return true; // out.data() may be null
+    std::memcpy(out.data(), file.data() + offset, bytes);
+    return true;
+}
+
+// Fills in the mesh geometry if the cache holds one saved from the same OBJ and
+// parameters, and none of its MTL files has changed since
+bool SceneCache::loadMesh(uint64_t key, Mesh& mesh, std::vector<Material>& materials,
+                          std::vector<std::string>& libraries) const {
+    if (!header || key == 0) return false;
+    for (uint32_t i = 0; i < header->meshCount; i++) {
+        const MeshEntry& entry = meshTable()[i];
+        if (entry.key != key) continue;
+        std::istringstream paths(std::string(file.data() + entry.libraryOffset, entry.libraryBytes));
+        libraries.clear();
+        for (std::string path; std::getline(paths, path); ) libraries.push_back(path);
+        if (libraryKey(libraries) != entry.libraryKey) return false;
+        
+        std::vector<Material> library;
+        if (!readBytes(entry.vertexOffset, entry.vertexBytes, mesh.vertices) ||
+            !readBytes(entry.indexOffset, entry.indexBytes, mesh.indices) ||
+            !readBytes(entry.materialOffset, entry.materialBytes, library) ||
+            !readBytes(entry.triangleMaterialOffset, entry.triangleMaterialBytes, mesh.triangleMaterials))
+            return false;
+        
+        // A damaged entry whose key still matches must not send traversal out of bounds
+        if (mesh.indices.size() % 3 != 0) return false;
+        for (uint32_t index : mesh.indices) {
+            if (index >= mesh.vertices.size()) return false;
+        }
+        if (!mesh.triangleMaterials.empty()) {
+            if (mesh.triangleMaterials.size() != mesh.triangleCount()) return false;
+            for (uint16_t m : mesh.triangleMaterials) {
+                if (m > library.size()) return false;
+            }
+        }
+        mesh.doubleSided = entry.doubleSided != 0;
+        if (!mesh.triangleMaterials.empty()) {
+            uint32_t own = mesh.material;
+            mesh.material = (uint32_t)materials.size();
+            mesh.materialCount = (uint32_t)library.size() + 1;
+            materials.push_back(materials[own]);
+            materials.insert(materials.end(), library.begin(), library.end());
+        }
+        return true;
+    }
+    return false;
+}
+
+// Restores the scene's BVH if the cache was saved for the same geometry and layout
+bool SceneCache::loadBVH(uint64_t key, Scene& scene, TriangleLayout layout) const {
+    if (!header || header->bvhKey != key || header->layout != (uint32_t)layout) return false;
+    BVH& bvh = scene.bvh;
+    TriangleSoA& tris = bvh.tris;
+    auto read = [&](Section section, auto& out) {
+        return readBytes(header->offset[section], header->bytes[section], out);
+    };
+    bool ok = read(Nodes, bvh.nodes) && read(Prims, bvh.prims);
+    std::vector<float>* arrays[] = { &tris.v0x, &tris.v0y, &tris.v0z, &tris.e1x, &tris.e1y, &tris.e1z,
+                                     &tris.e2x, &tris.e2y, &tris.e2z, &tris.nx, &tris.ny, &tris.nz };
+    for (int i = 0; i < 12; i++) ok = ok && read((Section)(TriV0x + i), *arrays[i]);
+    ok = ok && read(TriDoubleSided, tris.doubleSided);
+    tris.count = header->triangleCount;
+    size_t triangles = 0;
+    for (const Mesh& mesh : scene.meshes) triangles += mesh.triangleCount();
+    ok = ok && bvh.prims.size() == triangles && bvh.nodes.empty() == bvh.prims.empty();
+    if (ok && layout == TriangleLayout::Precomputed) {
+        ok = tris.count == bvh.prims.size() && tris.doubleSided.size() == tris.count + SIMD_PADDING;
+        for (int i = 0; ok && i < 12; i++) ok = arrays[i]->size() == tris.count + SIMD_PADDING;
+    }
+    for (size_t i = 0; ok && i < bvh.prims.size(); i++) {
+        const PrimRef& prim = bvh.prims[i];
+        ok = prim.mesh < scene.meshes.size() && prim.triangle < scene.meshes[prim.mesh].triangleCount();
+    }
+    
+    // Children come after their only parent, as every builder places them, which
+    // also rules out cycles, and the tree stays within the traversal stack depth
+    std::vector<uint32_t> depth(ok ? bvh.nodes.size() : 0, 0);
+    for (size_t n = 0; ok && n < bvh.nodes.size(); n++) {
+        const BVHNode& node = bvh.nodes[n];
+        if (node.isLeaf()) {
+            ok = node.leftFirst <= bvh.prims.size() && node.count <= bvh.prims.size() - node.leftFirst;
+        } else {
+            ok = node.leftFirst > n && node.leftFirst < bvh.nodes.size() - 1 && depth[n] < BVH_MAX_DEPTH &&
+                 depth[node.leftFirst] == 0 && depth[node.leftFirst + 1] == 0;
+            if (ok) depth[node.leftFirst] = depth[node.leftFirst + 1] = depth[n] + 1;
+        }
+    }
+    if (!ok) {
+        bvh = BVH();
+        return false;
+    }
+    bvh.attach(scene.meshes, layout);
+    return true;
+}
+
+bool SceneCache::save(const std::string& path, const std::vector<MeshSource>& sources,
+                      uint64_t bvhKey, const Scene& scene) {
+    const BVH& bvh = scene.bvh;
+    const TriangleSoA& tris = bvh.tris;
+    Header h = {};
+    h.magic = SCENE_CACHE_MAGIC;
+    h.version = SCENE_CACHE_VERSION;
+    h.bvhKey = bvhKey;
+    h.layout = (uint32_t)bvh.layout;
+    h.meshCount = (uint32_t)sources.size();
+    h.triangleCount = tris.count;
+    
+    // Every blob of the file in order, placed at aligned offsets after the mesh table
+    std::vector<std::pair<const void*, uint64_t>> blobs;
+    std::vector<MeshEntry> entries(sources.size());
+    std::vector<std::string> libraryPaths(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) {
+        const Mesh& mesh = scene.meshes[i];
+        for (const std::string& library : sources[i].libraries) libraryPaths[i] += library + "\n";
+        entries[i].key = sources[i].key;
+        entries[i].libraryKey = libraryKey(sources[i].libraries);
+        entries[i].libraryBytes = libraryPaths[i].size();
+        entries[i].doubleSided = mesh.doubleSided;
+        entries[i].vertexBytes = mesh.vertices.size() * sizeof(Vector3);
+        entries[i].indexBytes = mesh.indices.size() * sizeof(uint32_t);
+        entries[i].materialBytes = (mesh.materialCount - 1) * sizeof(Material);
+        entries[i].triangleMaterialBytes = mesh.triangleMaterials.size() * sizeof(uint16_t);
+        blobs.push_back({ mesh.vertices.data(), entries[i].vertexBytes });
+        blobs.push_back({ mesh.indices.data(), entries[i].indexBytes });
+        blobs.push_back({ scene.materials.data() + mesh.material + 1, entries[i].materialBytes });
+        blobs.push_back({ mesh.triangleMaterials.data(), entries[i].triangleMaterialBytes });
+        blobs.push_back({ libraryPaths[i].data(), entries[i].libraryBytes });
+    }
+    const void* data[SectionCount] = {
+        bvh.nodes.data(), bvh.prims.data(),
+        tris.v0x.data(), tris.v0y.data(), tris.v0z.data(), tris.e1x.data(), tris.e1y.data(), tris.e1z.data(),
+        tris.e2x.data(), tris.e2y.data(), tris.e2z.data(), tris.nx.data(), tris.ny.data(), tris.nz.data(),
+        tris.doubleSided.data()
+    };
+    h.bytes[Nodes] = bvh.nodes.size() * sizeof(BVHNode);
+    h.bytes[Prims] = bvh.prims.size() * sizeof(PrimRef);
+    for (int i = TriV0x; i <= TriNz; i++) h.bytes[i] = tris.v0x.size() * sizeof(float);
+    h.bytes[TriDoubleSided] = tris.doubleSided.size();
+    for (int i = 0; i < SectionCount; i++) blobs.push_back({ data[i], h.bytes[i] });
+    
+    auto align = [](uint64_t offset) { return (offset + SCENE_CACHE_ALIGN - 1) / SCENE_CACHE_ALIGN * SCENE_CACHE_ALIGN; };
+    std::vector<uint64_t> offsets;
+    uint64_t offset = align(sizeof(Header) + entries.size() * sizeof(MeshEntry));
+    for (const auto& blob : blobs) {
+        offsets.push_back(offset);
+        offset = align(offset + blob.second);
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].vertexOffset = offsets[5 * i];
+        entries[i].indexOffset = offsets[5 * i + 1];
+        entries[i].materialOffset = offsets[5 * i + 2];
+        entries[i].triangleMaterialOffset = offsets[5 * i + 3];
+        entries[i].libraryOffset = offsets[5 * i + 4];
+    }
+    for (int i = 0; i < SectionCount; i++) h.offset[i] = offsets[5 * entries.size() + i];
+    
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error opening scene cache file: " << path << "\n";
+        return false;
+    }
+    static const char zeros[SCENE_CACHE_ALIGN] = {};
+    file.write((const char*)&h, sizeof(h));
+    file.write((const char*)entries.data(), entries.size() * sizeof(MeshEntry));
+    uint64_t written = sizeof(h) + entries.size() * sizeof(MeshEntry);
+    for (size_t i = 0; i < blobs.size(); i++) {
+        file.write(zeros, offsets[i] - written);
+        file.write((const char*)blobs[i].first, blobs[i].second);
+        written = offsets[i] + blobs[i].second;
+    }
+    return (bool)file;
+}
+
+// Floor, back wall and the light indicators shared by all the standard scenes
+void addRoom(Scene& scene) {
+    // Add floor
+    Mesh floor;
+    floor.material = scene.addMaterial(Material{Vector3(0.3f, 0.6f, 0.3f)});
+    floor.doubleSided = true;
+    floor.vertices = { Vector3(-5, -1, -5), Vector3(5, -1, -5), Vector3(5, -1, 5), Vector3(-5, -1, 5) };
+    floor.indices = { 0, 1, 2, 0, 2, 3 };
+    scene.meshes.push_back(floor);
+    
+    // Add back wall
+    Mesh wall;
+    wall.material = scene.addMaterial(Material{Vector3(0.4f, 0.4f, 0.6f)});
+    wall.doubleSided = true;
+    wall.vertices = { Vector3(-5, 5, -5), Vector3(5, 5, -5), Vector3(5, -1, -5), Vector3(-5, -1, -5) };
+    wall.indices = { 0, 1, 2, 0, 2, 3 };
+    scene.meshes.push_back(wall);
+
+    // Add directional light indicators, one mesh for all the lights
+    Mesh indicator;
+    indicator.material = scene.addMaterial(Material{Vector3(1, 1, 0.5f), 0.5f});
+    indicator.doubleSided = true;
+    indicator.tracksLight = true;
+    for (const Light& light : scene.shading.lights) {
+        const Vector3 lightPos = light.position;
+        for (int i = 0; i < 3; i++) {
+            Vector3 offset(0.1f, 0.1f, 0.1f);
+            if (i == 1) offset = Vector3(-0.1f, 0.1f, 0.1f);
+            if (i == 2) offset = Vector3(0.1f, -0.1f, 0.1f);
+            indicator.addTriangle(
+                lightPos, 
+                lightPos + Vector3(0.2f, 0, 0) + offset,
+                lightPos + Vector3(0, 0.2f, 0) + offset);
+        }
+    }
+    if (!indicator.indices.empty()) scene.meshes.push_back(indicator);
+}
+
+// UV sphere with 2 * segments * (rings - 1) triangles
+Mesh makeSphere(Vector3 center, float radius, int rings, int segments, uint32_t material) {
+    Mesh mesh;
+    mesh.material = material;
+    mesh.doubleSided = true;
+    
+    for (int r = 0; r <= rings; r++) {
+        float theta = PI * r / rings;
+        for (int s = 0; s < segments; s++) {
+            float phi = 2 * PI * s / segments;
+            Vector3 dir(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            mesh.vertices.push_back(center + dir * radius);
+        }
+    }
+    for (int r = 0; r < rings; r++) {
+        for (int s = 0; s < segments; s++) {
+            uint32_t a = r * segments + s, b = r * segments + (s + 1) % segments;
+            uint32_t c = a + segments, d = b + segments;
+            if (r > 0) mesh.indices.insert(mesh.indices.end(), { a, b, c });
+            if (r < rings - 1) mesh.indices.insert(mesh.indices.end(), { b, d, c });
+        }
+    }
+    return mesh;
+}
+
+double elapsedMs(std::chrono::high_resolution_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - since).count();
+}
+
+// Peak resident set size of the whole process so far. The benchmark calls it
+// from a forked child per run (see runIsolated()), where it covers that run only.
+size_t peakMemoryBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Result of one benchmark render, copied back from the child it ran in
+struct BenchRun {
+    double renderMs = 0;
+    RayStats totals;
+    size_t peakMemoryBytes = 0; // 0 when the run could not be measured on its own
+};
+
+// Runs one benchmark render in a forked child, so its peak memory is the loaded
+// scene plus what this render allocates rather than the largest run so far.
+// Threads do not survive fork(), so run() must create its own pool. Falls back
+// to running in this process, without a peak, on Windows or if fork() fails.
+BenchRun runIsolated(const std::function<BenchRun()>& run) {
+    static_assert(std::is_trivially_copyable<BenchRun>::value, "sent through a pipe");
+#ifndef _WIN32
+    std::cout.flush();
+    std::cerr.flush();
+#ifdef __GLIBC__
+    malloc_trim(0); // Give earlier scenes' freed memory back so the child does not start with it
+#endif
+    int fds[2];
+    if (pipe(fds) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            BenchRun result = run();
+            result.peakMemoryBytes = peakMemoryBytes();
+            bool sent = write(fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result);
+            _exit(sent ? 0 : 1);
+        }
+        close(fds[1]);
+        if (pid > 0) {
+            BenchRun result;
+            size_t received = 0;
+            while (received < sizeof(result)) {
+                ssize_t n = read(fds[0], (char*)&result + received, sizeof(result) - received);
+                if (n <= 0) break;
+                received += n;
+            }
+            close(fds[0]);
+            int status = 0;
+            waitpid(pid, &status, 0);
+            if (received == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0) return result;
+            std::cerr << "Warning: benchmark child process failed, running in this process\n";
+        } else {
+            close(fds[0]);
+        }
+    }
+#endif
+    return run();
+}
+
+// Renders the standard scenes at a few resolutions and thread counts and prints
+// one JSON document with per-stage timings to stdout
+int runBenchmark(const std::string& objPath) {
+    struct BenchScene {
+        const char* name;
+        std::function<void(Scene&, ThreadPool&)> setup;
+    };
+    const BenchScene scenes[] = {
+        { "neshto", [&](Scene& scene, ThreadPool& pool) {
+            uint32_t bronze = scene.addMaterial(Material{Vector3(0.8f, 0.5f, 0.2f), 0.5f});
+            scene.meshes.push_back(loadOBJ(objPath, bronze, 1.0f, Vector3(0, 0, -2), true, &pool));
+            addRoom(scene);
+        } },
+        { "spheres", [&](Scene& scene, ThreadPool&) {
+            uint32_t bronze = scene.addMaterial(Material{Vector3(0.8f, 0.5f, 0.2f), 0.5f});
+            uint32_t matte = scene.addMaterial(Material{Vector3(0.5f, 0.5f, 0.5f)});
+            scene.meshes.push_back(makeSphere(Vector3(0, 0.5f, -2), 1.5f, 256, 512, bronze));
+            scene.meshes.push_back(makeSphere(Vector3(-2.5f, 0, -1), 1.0f, 128, 256, matte));
+            scene.meshes.push_back(makeSphere(Vector3(2.5f, 0, -1), 1.0f, 128, 256, matte));
+            addRoom(scene);
+        } },
+        { "instances", [&](Scene& scene, ThreadPool&) {
+            // One sphere placed 10x10 times, each copy turned so no two line up
+            uint32_t bronze = scene.addMaterial(Material{Vector3(0.8f, 0.5f, 0.2f), 0.5f});
+            uint32_t prototype = scene.addPrototype(makeSphere(Vector3(), 1.0f, 64, 128, bronze));
+            for (int z = 0; z < 10; z++) {
+                for (int x = 0; x < 10; x++) {
+                    Vector3 position(x * 0.9f - 4.05f, -0.6f + 0.1f * (x % 3), z * -0.9f + 1.0f);
+                    scene.addInstance(prototype, Transform::make(position, 0.35f, (x * 10 + z) * 7.0f), bronze);
+                }
+            }
+            addRoom(scene);
+        } },
+        { "lights", [&](Scene& scene, ThreadPool&) {
+            // 16x16 small area lights of mixed power under the ceiling; hits still
+            // cast at most lightSamples shadow rays each
+            scene.shading.lights.clear();
+            for (int z = 0; z < 16; z++) {
+                for (int x = 0; x < 16; x++) {
+                    Light light;
+                    light.position = Vector3(x * 0.6f - 4.5f, 4.5f, z * -0.5f + 2.5f);
+                    light.color = Vector3(1.0f + (x % 4), 1.0f + (z % 3), 1.0f + ((x + z) % 2)) * (1.0f / 600);
+                    light.radius = 0.05f;
+                    scene.shading.lights.push_back(light);
+                }
+            }
+            uint32_t bronze = scene.addMaterial(Material{Vector3(0.8f, 0.5f, 0.2f), 0.5f});
+            uint32_t matte = scene.addMaterial(Material{Vector3(0.5f, 0.5f, 0.5f)});
+            scene.meshes.push_back(makeSphere(Vector3(0, 0.5f, -2), 1.5f, 64, 128, bronze));
+            scene.meshes.push_back(makeSphere(Vector3(-2.5f, 0, -1), 1.0f, 32, 64, matte));
+            scene.meshes.push_back(makeSphere(Vector3(2.5f, 0, -1), 1.0f, 32, 64, matte));
+            addRoom(scene);
+        } },
+        { "room", [&](Scene& scene, ThreadPool&) { addRoom(scene); } },
+    };
+    const std::pair<int, int> resolutions[] = { { 320, 240 }, { 800, 600 }, { 1920, 1080 } };
+    
+    unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> threadCounts = { 1 };
+    if (maxThreads > 2) threadCounts.push_back(maxThreads / 2);
+    if (maxThreads > 1) threadCounts.push_back(maxThreads);
+    
+    const Camera camera(Vector3(0, 1.5, 4));
+    ThreadPool loadPool(maxThreads);
+    
+    std::cout << "{\n  \"kernels\": \"" << leafKernels.name << "\",\n  \"results\": [";
+    bool firstResult = true;
+    std::ostringstream builds, raySorting, compression, allocations;
+    for (const auto& bench : scenes) {
+        Scene scene;
+        auto loadStart = std::chrono::high_resolution_clock::now();
+        bench.setup(scene, loadPool);
+        double loadMs = elapsedMs(loadStart);
+        
+        // Every builder on every thread count, with tree quality and the 800x600
+        // render time on all threads to show what the quality costs at runtime
+        for (BVHBuilder builder : { BVHBuilder::Sweep, BVHBuilder::Binned, BVHBuilder::LBVH }) {
+            for (unsigned threads : threadCounts) {
+                ThreadPool pool(threads);
+                auto start = std::chrono::high_resolution_clock::now();
+                scene.build(TriangleLayout::Precomputed, builder, &pool);
+                double ms = elapsedMs(start);
+                BVHStats tree = scene.bvh.stats();
+                
+                double renderMs = 0;
+                if (threads == threadCounts.back()) {
+                    std::vector<Vector3> image(800 * 600);
+                    RenderProgress progress(0, false);
+                    auto renderStart = std::chrono::high_resolution_clock::now();
+                    renderBand(pool, scene, camera, 800, 600, 0, 600, image.data(), progress);
+                    renderMs = elapsedMs(renderStart);
+                }
+                
+                builds << (builds.tellp() > 0 ? ",\n" : "\n") << "    { \"scene\": \"" << bench.name
+                       << "\", \"builder\": \"" << builderName(builder) << "\", \"threads\": " << threads
+                       << ", \"buildMs\": " << ms << ", \"nodes\": " << tree.nodeCount
+                       << ", \"leaves\": " << tree.leafCount << ", \"maxDepth\": " << tree.maxDepth
+                       << ", \"averageLeafSize\": " << tree.averageLeafSize << ", \"sahCost\": " << tree.sahCost;
+                if (renderMs > 0) builds << ", \"renderMs800x600\": " << renderMs;
+                builds << " }";
+            }
+        }
+        
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        scene.build();
+        double buildMs = elapsedMs(buildStart);
+        std::cerr << "Benchmark scene " << bench.name << ": " << scene.triangleCount() << " triangles\n";
+        
+        // Moving instances only touches the top level: shift every one and back
+        double refitMs = 0;
+        if (!scene.instances.empty()) {
+            auto refitStart = std::chrono::high_resolution_clock::now();
+            for (float dy : { 0.5f, -0.5f }) {
+                for (uint32_t i = 0; i < scene.instances.size(); i++) {
+                    Transform moved = scene.instances[i].toWorld;
+                    moved.m[1][3] += dy;
+                    scene.setInstanceTransform(i, moved);
+                }
+                scene.refitInstances();
+            }
+            refitMs = elapsedMs(refitStart) / 2;
+        }
+        
+        for (unsigned threads : threadCounts) {
+            for (const auto& res : resolutions) {
+                int width = res.first, height = res.second;
+                BenchRun run = runIsolated([&] {
+                    ThreadPool pool(threads);
+                    std::vector<Vector3> image((size_t)width * height);
+                    RenderProgress progress(0, false);
+                    FrameStats stats(pool.size());
+                    
+                    BenchRun result;
+                    auto renderStart = std::chrono::high_resolution_clock::now();
+                    renderBand(pool, scene, camera, width, height, 0, height, image.data(), progress, &stats);
+                    result.renderMs = elapsedMs(renderStart);
+                    result.totals = stats.total();
+                    return result;
+                });
+                double renderMs = run.renderMs;
+                uint64_t primaryRays = (uint64_t)width * height;
+#if RT_ENABLE_STATS
+                const RayStats& totals = run.totals;
+#endif
+                
+                std::cout << (firstResult ? "\n" : ",\n") << "    { \"scene\": \"" << bench.name
+                          << "\", \"triangles\": " << scene.triangleCount()
+                          << ", \"width\": " << width << ", \"height\": " << height
+                          << ", \"threads\": " << threads
+                          << ", \"instances\": " << scene.instances.size()
+                          << ", \"lights\": " << scene.shading.lights.size()
+                          << ", \"loadMs\": " << loadMs << ", \"buildMs\": " << buildMs
+                          << ", \"refitMs\": " << refitMs
+                          << ", \"renderMs\": " << renderMs
+                          << ", \"primaryRays\": " << primaryRays
+                          << ", \"primaryRaysPerSecond\": " << (uint64_t)(primaryRays * 1000.0 / std::max(renderMs, 1e-3))
+#if RT_ENABLE_STATS
+                          << ", \"rays\": " << totals.totalRays()
+                          << ", \"raysPerSecond\": " << (uint64_t)(totals.totalRays() * 1000.0 / std::max(renderMs, 1e-3))
+                          << ", \"shadowRays\": " << totals.shadowRays
+                          << ", \"reflectionRays\": " << totals.reflectionRays
+                          << ", \"triangleTests\": " << totals.triangleTests
+                          << ", \"nodeVisits\": " << totals.nodeVisits
+#endif
+#if RT_ALLOCATION_STATS
+                          << ", \"tileAllocations\": " << totals.allocations
+#endif
+                          << ", \"bvhBytes\": " << scene.bvhBytes();
+                if (run.peakMemoryBytes > 0) std::cout << ", \"peakMemoryBytes\": " << run.peakMemoryBytes;
+                std::cout << " }";
+                firstResult = false;
+            }
+        }
+        
+        // Wavefront renders with and without coherence binning of the secondary rays
+        ThreadPool pool(maxThreads);
+        double sortMs[2];
+        for (bool sortRays : { false, true }) {
+            RenderSettings settings;
+            settings.mode = RenderMode::Wavefront;
+            settings.sortRays = sortRays;
+            std::vector<Vector3> image(800 * 600);
+            RenderProgress progress(0, false);
+            auto renderStart = std::chrono::high_resolution_clock::now();
+            renderBand(pool, scene, camera, 800, 600, 0, 600, image.data(), progress, nullptr, nullptr, settings);
+            sortMs[sortRays] = elapsedMs(renderStart);
+        }
+        raySorting << (raySorting.tellp() > 0 ? ",\n" : "\n") << "    { \"scene\": \"" << bench.name
+                   << "\", \"threads\": " << maxThreads << ", \"unsortedMs800x600\": " << sortMs[0]
+                   << ", \"sortedMs800x600\": " << sortMs[1] << " }";
+        
+        // Compressed BVHs against the binary tree: memory, then the same 800x600 render
+        std::vector<Vector3> binaryImage;
+        for (const char* mode : { "none", "nodes", "all" }) {
+            bool binary = mode == std::string("none");
+            scene.build(TriangleLayout::Precomputed, BVHBuilder::Sweep, &pool);
+            if (!binary && !scene.compress(mode == std::string("all"))) continue;
+            std::vector<Vector3> image(800 * 600);
+            RenderProgress progress(0, false);
+            FrameStats stats(pool.size());
+            auto renderStart = std::chrono::high_resolution_clock::now();
+            renderBand(pool, scene, camera, 800, 600, 0, 600, image.data(), progress, &stats);
+            double renderMs = elapsedMs(renderStart);
+            int maxPixelDiff = 0;
+            if (binary) binaryImage = image;
+            for (size_t i = 0; i < image.size(); i++) {
+                const Vector3& a = binaryImage[i];
+                const Vector3& b = image[i];
+                maxPixelDiff = std::max({ maxPixelDiff, std::abs(toByte(a.x) - toByte(b.x)),
+                                          std::abs(toByte(a.y) - toByte(b.y)), std::abs(toByte(a.z) - toByte(b.z)) });
+            }
+            uint64_t rays = 800 * 600;
+#if RT_ENABLE_STATS
+            rays = stats.total().totalRays();
+#endif
+            compression << (compression.tellp() > 0 ? ",\n" : "\n") << "    { \"scene\": \"" << bench.name
+                        << "\", \"compression\": \"" << mode
+                        << "\", \"threads\": " << maxThreads << ", \"bvhBytes\": " << scene.bvhBytes()
+                        << ", \"renderMs800x600\": " << renderMs
+                        << ", \"raysPerSecond\": " << (uint64_t)(rays * 1000.0 / std::max(renderMs, 1e-3))
+                        << ", \"maxPixelDiff\": " << maxPixelDiff << " }";
+        }
+        scene.build(TriangleLayout::Precomputed, BVHBuilder::Sweep, &pool);
+        
+#if RT_ALLOCATION_STATS
+        // The tile loops must not touch the heap in any render mode
+        for (RenderMode mode : { RenderMode::Recursive, RenderMode::Wavefront }) {
+            for (int samples : { 1, 8 }) {
+                RenderSettings settings;
+                settings.mode = mode;
+                settings.maxSamples = samples;
+                std::vector<Vector3> image(320 * 240);
+                RenderProgress progress(0, false);
+                FrameStats stats(pool.size());
+                renderBand(pool, scene, camera, 320, 240, 0, 240, image.data(), progress, &stats, nullptr, settings);
+                uint64_t count = stats.total().allocations;
+                if (count > 0) std::cerr << "Warning: " << bench.name << " render tiles made " << count << " heap allocations\n";
+                allocations << (allocations.tellp() > 0 ? ",\n" : "\n") << "    { \"scene\": \"" << bench.name
+                            << "\", \"mode\": \"" << (mode == RenderMode::Wavefront ? "wavefront" : "recursive")
+                            << "\", \"samples\": " << samples << ", \"tileAllocations\": " << count << " }";
+            }
+        }
+#endif
+    }
+    std::cout << "\n  ],\n  \"builds\": [" << builds.str() << "\n  ]";
+    std::cout << ",\n  \"raySorting\": [" << raySorting.str() << "\n  ]";
+    std::cout << ",\n  \"compression\": [" << compression.str() << "\n  ]";
+#if RT_ALLOCATION_STATS
+    std::cout << ",\n  \"allocations\": [" << allocations.str() << "\n  ]";
+#endif
+    std::cout << "\n}\n";
+    return 0;
+}
+
+// One .obj file in the scene and how it is placed
+struct ObjectConfig {
+    std::string path;
+    float scale = 1.0f;
+    Vector3 offset;
+    Vector3 color = Vector3(0.8f, 0.5f, 0.2f); // Bronze color
+    float reflectivity = 0.5f;                  // For faces without an MTL material
+    bool doubleSided = true;
+    bool instanced = false;  // Shares one copy of the file's triangles with other instances of it
+    float rotateY = 0.0f;    // Degrees, instances only
+};
+
+// Camera position plus an optional point to look at
+struct CameraPose {
+    Vector3 position;
+    Vector3 target;
+    bool hasTarget = false;
+    
+    Camera camera() const { return hasTarget ? Camera::lookAt(position, target) : Camera(position); }
+};
+
+// One image of a batch. For animation, meshes lists OBJ files with the same
+// topology as the scene's objects, in order; their vertices replace the
+// objects' for this frame and the BVH is refitted rather than rebuilt.
+struct BatchFrame : CameraPose {
+    std::vector<std::string> meshes;
+};
+
+enum class BVHCompression {
+    None,
+    Nodes, // Quantized wide nodes, full precision triangles
+    All    // Quantized vertices too
+};
+
+bool parseCompression(const std::string& name, BVHCompression& compression) {
+    if (name == "none") compression = BVHCompression::None;
+    else if (name == "nodes") compression = BVHCompression::Nodes;
+    else if (name == "all") compression = BVHCompression::All;
+    else return false;
+    return true;
+}
+
+// Everything a run is configured with. The defaults are the original scene; a
+// scene file is applied on top of them and command line flags on top of that.
+struct RenderConfig {
+    int width = 800;
+    int height = 600;
+    CameraPose camera = { Vector3(0, 1.5f, 4), Vector3(), false };
+    std::vector<BatchFrame> frames;    // Batch mode renders one image per frame when set
+    ShadingParams shading;
+    std::vector<ObjectConfig> objects; // Neshto.obj when empty
+    unsigned threads = 0;              // 0 = one per core
+    RenderSettings settings;
+    std::string outputPath = "output.ppm";
+    ImageFormat format = ImageFormat::P6;
+    PixelFormat framebufferFormat = PixelFormat::Float;
+    bool stream = false;
+    bool heatmap = false;
+    TriangleLayout layout = TriangleLayout::Precomputed;
+    BVHBuilder builder = BVHBuilder::Sweep;
+    BVHCompression compression = BVHCompression::None;
+    std::string cachePath;
+    std::string gbufferPath;
+    double previewBudgetMs = 0;        // Renders through Renderer in calls of this budget when set
+    std::string coordinatorPort;       // Leases bands of the frame to workers when set
+    std::string workerAddress;         // HOST:PORT of the coordinator to render bands for
+};
+
+// Parses "x,y,z"
+bool parseVector3(const char* text, Vector3& v) {
+    return sscanf(text, "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+bool parseBuilder(const std::string& name, BVHBuilder& builder) {
+    for (BVHBuilder b : { BVHBuilder::Sweep, BVHBuilder::Binned, BVHBuilder::LBVH }) {
+        if (name == builderName(b)) {
+            builder = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+// "x y z" with an optional "tx ty tz" look-at target after it
+bool readPose(std::istream& in, CameraPose& pose) {
+    if (!(in >> pose.position.x >> pose.position.y >> pose.position.z)) return false;
+    pose.hasTarget = (bool)(in >> pose.target.x >> pose.target.y >> pose.target.z);
+    return true;
+}
+
+// A pose followed by any number of "mesh file.obj"
+bool readFrame(std::istream& in, BatchFrame& frame) {
+    if (!readPose(in, frame)) return false;
+    if (!frame.hasTarget) in.clear();
+    std::string word, path;
+    while (in >> word) {
+        if (word != "mesh" || !(in >> path)) return false;
+        frame.meshes.push_back(path);
+    }
+    return true;
+}
+
+// One frame per line, # starts a comment
+bool loadFrames(const std::string& path, std::vector<BatchFrame>& frames) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Error opening frame list: " << path << "\n";
+        return false;
+    }
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        std::istringstream in(line);
+        BatchFrame frame;
+        if (!readFrame(in, frame)) {
+            std::cerr << path << ":" << lineNumber << ": expected a camera position and mesh files\n";
+            return false;
+        }
+        frames.push_back(frame);
+    }
+    return true;
+}
+
+bool parseFormat(const std::string& name, ImageFormat& format) {
+    if (name == "p3") format = ImageFormat::P3;
+    else if (name == "p6") format = ImageFormat::P6;
+    else return false;
+    return true;
+}
+
+bool parsePixelFormat(const std::string& name, PixelFormat& format) {
+    for (PixelFormat f : { PixelFormat::Float, PixelFormat::Half, PixelFormat::RGBE }) {
+        if (name == pixelFormatName(f)) {
+            format = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads a scene file: one "key values..." setting per line, # starts a comment.
+//
+//   resolution 1920 1080
+//   camera 0 1.5 4
+//   light 2 5 1
+//   obj Neshto.obj offset 0 0 -2 color 0.8 0.5 0.2
+//
+// light takes optional color and radius attributes and can be repeated; the
+// scene file's lights replace the default one. light-samples caps the shadow
+// rays per hit.
+// look x y z points the camera at a target. Each frame line (same arguments as
+// camera, plus an optional target) adds one image to a batch render.
+// The other keys are ambient, specular, threads, samples, threshold, format
+// (p3/p6), framebuffer (float/half/rgbe), output, builder, cache, gbuffer and
+// compress (nodes/all), plus the switches stream, heatmap, wavefront,
+// fast-shading and indexed. obj takes optional scale, offset, color, reflect
+// and single-sided attributes and can be repeated. instance takes the same plus
+// rotate (degrees about the vertical axis) and shares one copy of the file's
+// triangles with the other instances of it.
+bool loadSceneFile(const std::string& path, RenderConfig& config) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Error opening scene file: " << path << "\n";
+        return false;
+    }
+    
+    std::vector<ObjectConfig> objects;
+    std::vector<Light> lights;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream in(line);
+        std::string key;
+        if (!(in >> key)) continue;
+        
+        bool ok = true;
+        auto readVector = [&](Vector3& v) { ok = ok && (bool)(in >> v.x >> v.y >> v.z); };
+        if (key == "resolution") ok = (bool)(in >> config.width >> config.height) && config.width > 0 && config.height > 0;
+        else if (key == "camera") readVector(config.camera.position);
+        else if (key == "look") { readVector(config.camera.target); config.camera.hasTarget = true; }
+        else if (key == "frame") { BatchFrame frame; ok = readFrame(in, frame); config.frames.push_back(frame); }
+        else if (key == "light") {
+            Light light;
+            readVector(light.position);
+            std::string attribute;
+            while (ok && in >> attribute) {
+                if (attribute == "color") readVector(light.color);
+                else if (attribute == "radius") ok = (bool)(in >> light.radius) && light.radius >= 0;
+                else ok = false;
+            }
+            lights.push_back(light);
+        }
+        else if (key == "light-samples") {
+            ok = (bool)(in >> config.shading.lightSamples) && config.shading.lightSamples >= 1 &&
+                 config.shading.lightSamples <= MAX_LIGHT_SAMPLES;
+        }
+        else if (key == "ambient") ok = (bool)(in >> config.shading.ambientStrength);
+        else if (key == "specular") ok = (bool)(in >> config.shading.specularStrength);
+        else if (key == "threads") ok = (bool)(in >> config.threads);
+        else if (key == "samples") ok = (bool)(in >> config.settings.maxSamples) && config.settings.maxSamples >= 1;
+        else if (key == "threshold") ok = (bool)(in >> config.settings.varianceThreshold);
+        else if (key == "output") ok = (bool)(in >> config.outputPath);
+        else if (key == "cache") ok = (bool)(in >> config.cachePath);
+        else if (key == "gbuffer") ok = (bool)(in >> config.gbufferPath);
+        else if (key == "format") { std::string name; ok = (in >> name) && parseFormat(name, config.format); }
+        else if (key == "builder") { std::string name; ok = (in >> name) && parseBuilder(name, config.builder); }
+        else if (key == "compress") {
+            std::string name;
+            ok = (in >> name) && parseCompression(name, config.compression);
+        }
+        else if (key == "framebuffer") {
+            std::string name;
+            ok = (in >> name) && parsePixelFormat(name, config.framebufferFormat);
+        }
+        else if (key == "stream") config.stream = true;
+        else if (key == "heatmap") config.heatmap = true;
+        else if (key == "wavefront") config.settings.mode = RenderMode::Wavefront;
+        else if (key == "indexed") config.layout = TriangleLayout::Indexed;
+        else if (key == "fast-shading") config.settings.precision = ShadingPrecision::Fast;
+        else if (key == "obj" || key == "instance") {
+            ObjectConfig object;
+            object.instanced = key == "instance";
+            ok = (bool)(in >> object.path);
+            std::string attribute;
+            while (ok && in >> attribute) {
+                if (attribute == "scale") ok = (bool)(in >> object.scale);
+                else if (attribute == "offset") readVector(object.offset);
+                else if (attribute == "color") readVector(object.color);
+                else if (attribute == "reflect") ok = (bool)(in >> object.reflectivity);
+                else if (attribute == "single-sided") object.doubleSided = false;
+                else if (attribute == "rotate" && object.instanced) ok = (bool)(in >> object.rotateY);
+                else ok = false;
+            }
+            objects.push_back(object);
+        }
+        else {
+            std::cerr << path << ":" << lineNumber << ": unknown setting '" << key << "'\n";
+            return false;
+        }
+        if (!ok) {
+            std::cerr << path << ":" << lineNumber << ": bad value for '" << key << "'\n";
+            return false;
+        }
+    }
+    if (!objects.empty()) config.objects = objects;
+    if (!lights.empty()) config.shading.lights = lights;
+    return true;
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--scene file] [-o output.ppm|-] [--size WxH] [--camera x,y,z] [--look x,y,z] [--frames file]"
+              << " [--obj file]... [--threads N] [--format p3|p6] [--p3] [--stream] [--framebuffer float|half|rgbe]"
+              << " [--samples N] [--threshold T] [--preview MS] [--wavefront] [--fast-shading] [--indexed] [--builder sweep|binned|lbvh] [--compress nodes|all]"
+              << " [--light x,y,z]... [--light-samples N] [--ambient A] [--specular S] [--color r,g,b]"
+              << " [--cache file] [--gbuffer file] [--heatmap] [--benchmark]"
+              << " [--coordinator PORT | --worker HOST:PORT]\n";
+}
+
+// Applies the scene file named by --scene, then every other flag on top of it.
+// Returns false on a bad flag or scene file.
+bool parseArgs(int argc, char** argv, RenderConfig& config, bool& benchmark) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--scene" && !loadSceneFile(argv[i + 1], config)) return false;
+    }
+    
+    std::vector<ObjectConfig> objects;
+    std::vector<Light> lights;
+    Light light;
+    bool recolor = false;
+    Vector3 color;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--scene" && hasValue) i++;
+        else if (arg == "-o" && hasValue) config.outputPath = argv[++i];
+        else if (arg == "--size" && hasValue && sscanf(argv[i + 1], "%dx%d", &config.width, &config.height) == 2 &&
+                 config.width > 0 && config.height > 0) i++;
+        else if (arg == "--camera" && hasValue && parseVector3(argv[i + 1], config.camera.position)) i++;
+        else if (arg == "--look" && hasValue && parseVector3(argv[i + 1], config.camera.target)) {
+            config.camera.hasTarget = true;
+            i++;
+        }
+        else if (arg == "--frames" && hasValue) {
+            config.frames.clear();
+            if (!loadFrames(argv[++i], config.frames)) return false;
+        }
+        else if (arg == "--obj" && hasValue) { objects.push_back(ObjectConfig()); objects.back().path = argv[++i]; }
+        else if (arg == "--threads" && hasValue) config.threads = (unsigned)std::max(0, atoi(argv[++i]));
+        else if (arg == "--format" && hasValue && parseFormat(argv[i + 1], config.format)) i++;
+        else if (arg == "--stream") config.stream = true;
+        else if (arg == "--compress" && hasValue && parseCompression(argv[i + 1], config.compression)) i++;
+        else if (arg == "--preview" && hasValue) config.previewBudgetMs = std::max(1.0, atof(argv[++i]));
+        else if (arg == "--framebuffer" && hasValue && parsePixelFormat(argv[i + 1], config.framebufferFormat)) i++;
+        else if (arg == "--p3") config.format = ImageFormat::P3;
+        else if (arg == "--indexed") config.layout = TriangleLayout::Indexed;
+        else if (arg == "--builder" && hasValue && parseBuilder(argv[i + 1], config.builder)) i++;
+        else if (arg == "--benchmark") benchmark = true;
+        else if (arg == "--heatmap") config.heatmap = true;
+        else if (arg == "--wavefront") config.settings.mode = RenderMode::Wavefront;
+        else if (arg == "--fast-shading") config.settings.precision = ShadingPrecision::Fast;
+        else if (arg == "--samples" && hasValue) config.settings.maxSamples = std::max(1, atoi(argv[++i]));
+        else if (arg == "--threshold" && hasValue) config.settings.varianceThreshold = (float)atof(argv[++i]);
+        else if (arg == "--gbuffer" && hasValue) config.gbufferPath = argv[++i];
+        else if (arg == "--cache" && hasValue) config.cachePath = argv[++i];
+        else if (arg == "--coordinator" && hasValue) config.coordinatorPort = argv[++i];
+        else if (arg == "--worker" && hasValue) config.workerAddress = argv[++i];
+        else if (arg == "--ambient" && hasValue) config.shading.ambientStrength = (float)atof(argv[++i]);
+        else if (arg == "--specular" && hasValue) config.shading.specularStrength = (float)atof(argv[++i]);
+        else if (arg == "--light" && hasValue && parseVector3(argv[i + 1], light.position)) { lights.push_back(light); i++; }
+        else if (arg == "--light-samples" && hasValue) {
+            config.shading.lightSamples = std::min(std::max(1, atoi(argv[++i])), MAX_LIGHT_SAMPLES);
+        }
+        else if (arg == "--color" && hasValue && parseVector3(argv[i + 1], color)) { recolor = true; i++; }
+        else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    
+    // --obj and --light replace the scene file's lists, --color recolors every object
+    if (!objects.empty()) config.objects = objects;
+    if (!lights.empty()) config.shading.lights = lights;
+    if (config.objects.empty()) {
+        ObjectConfig neshto;
+        neshto.path = "Neshto.obj";
+        neshto.offset = Vector3(0, 0, -2);
+        config.objects.push_back(neshto);
+    }
+    if (recolor) {
+        for (auto& object : config.objects) object.color = color;
+    }
+    // Frames without a target of their own look where the camera does
+    for (auto& frame : config.frames) {
+        if (!frame.hasTarget && config.camera.hasTarget) {
+            frame.target = config.camera.target;
+            frame.hasTarget = true;
+        }
+    }
+    return true;
+}
+
+// Loads the configured objects, adds the room and builds the BVH, going through
+// the scene cache when one is configured
+void setupScene(const RenderConfig& config, Scene& scene, ThreadPool& pool) {
+    scene.shading = config.shading;
+    scene.shading.prepareLights();
+    
+    // The scene cache stands in for the OBJ parse and the BVH build when it matches
+    SceneCache cache;
+    bool useCache = !config.cachePath.empty();
+    bool cacheOpen = useCache && cache.open(config.cachePath);
+    bool cacheStale = false;
+    
+    // Load objs. Instanced files are loaded once, untransformed, as a prototype.
+    std::vector<SceneCache::MeshSource> meshSources;
+    std::map<std::pair<std::string, bool>, uint32_t> prototypeIds;
+    for (const ObjectConfig& object : config.objects) {
+        uint32_t material = scene.addMaterial(Material{object.color, object.reflectivity});
+        if (object.instanced) {
+            auto found = prototypeIds.find({ object.path, object.doubleSided });
+            uint32_t prototype;
+            if (found != prototypeIds.end()) prototype = found->second;
+            else {
+                prototype = scene.addPrototype(loadOBJ(object.path, material, 1.0f, Vector3(), object.doubleSided, &pool,
+                                                       &scene.materials));
+                prototypeIds[{ object.path, object.doubleSided }] = prototype;
+            }
+            scene.addInstance(prototype, Transform::make(object.offset, object.scale, object.rotateY), material);
+            continue;
+        }
+        SceneCache::MeshSource source;
+        source.key = useCache ? objKey(object.path, object.scale, object.offset, object.doubleSided) : 0;
+        Mesh mesh;
+        mesh.material = material;
+        if (cacheOpen && cache.loadMesh(source.key, mesh, scene.materials, source.libraries)) {
+            std::cerr << "Loaded " << mesh.triangleCount() << " triangles (" << mesh.vertices.size()
+                      << " vertices) of " << object.path << " from " << config.cachePath << "\n";
+        } else {
+            mesh = loadOBJ(object.path, material, object.scale, object.offset, object.doubleSided, &pool, &scene.materials);
+            if (useCache) source.libraries = objMaterialLibraries(object.path);
+            cacheStale = true;
+        }
+        scene.meshes.push_back(std::move(mesh));
+        meshSources.push_back(std::move(source));
+    }
+    
+    // Add floor, back wall and light indicator
+    addRoom(scene);
+
+    // Build acceleration structure
+    auto buildStart = std::chrono::high_resolution_clock::now();
+    uint64_t bvhKey = useCache ? sceneKey(meshSources, scene, config.layout, config.builder) : 0;
+    bool bvhCached = cacheOpen && cache.loadBVH(bvhKey, scene, config.layout);
+    if (!bvhCached) {
+        scene.build(config.layout, config.builder, &pool);
+        cacheStale = true;
+    } else {
+        // The cache only holds the flat geometry
+        scene.buildInstances(config.layout, config.builder, &pool);
+    }
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    std::cerr << (bvhCached ? "Loaded BVH with " : "Built BVH with ") << scene.bvh.nodes.size() << " nodes in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(buildEnd - buildStart).count() << " ms ("
+              << scene.meshBytes() / 1024 << " KB meshes, " << scene.bvhBytes() / 1024 << " KB BVH)\n";
+    if (!scene.instances.empty()) {
+        std::cerr << "Placed " << scene.instances.size() << " instances of " << scene.prototypes.size()
+                  << " prototypes, " << scene.triangleCount() << " triangles in total\n";
+    }
+    
+    cache.close();
+    if (useCache && cacheStale) {
+        if (SceneCache::save(config.cachePath, meshSources, bvhKey, scene))
+            std::cerr << "Saved scene cache " << config.cachePath << "\n";
+    }
+    
+    // The cache keeps the binary tree, so compression comes after it
+    if (config.compression != BVHCompression::None) {
+        size_t binaryBytes = scene.bvhBytes();
+        if (scene.compress(config.compression == BVHCompression::All))
+            std::cerr << "Compressed the BVH from " << binaryBytes / 1024 << " KB to " << scene.bvhBytes() / 1024 << " KB\n";
+        else
+            std::cerr << "Some BVH leaves are too big to compress, keeping the binary tree for them\n";
+    }
+}
+
+// Renders the configured image and writes it (plus the heatmap) out. Returns the exit code.
+int renderImage(const RenderConfig& config, const Scene& scene, ThreadPool& pool) {
+    const int width = config.width;
+    const int height = config.height;
+    const Camera camera = config.camera.camera();
+    RenderSettings settings = config.settings;
+    
+    std::cerr << "Rendering " << width << "x" << height << " image on " << pool.size() << " threads ("
+              << scene.bvh.kernelName() << " kernels)...\n";
+    
+    // Primary hits are cached across runs that only change shading
+    GBuffer gbuffer;
+    std::string gbufferPath = config.gbufferPath;
+    if (!gbufferPath.empty()) {
+        if (settings.maxSamples > 1) {
+            std::cerr << "The G-buffer holds one sample per pixel, ignoring it with --samples\n";
+            gbufferPath.clear();
+        } else {
+            gbuffer.reset(gbufferKey(scene, camera, width, height), width, height);
+            if (gbuffer.load(gbufferPath))
+                std::cerr << "Reusing G-buffer " << gbufferPath << ", skipping primary traversal\n";
+            settings.gbuffer = &gbuffer;
+        }
+    }
+    
+    PPMWriter writer;
+    if (!writer.open(config.outputPath, width, height, config.format)) return 1;
+    
+    auto start = std::chrono::high_resolution_clock::now();
+    
+    // Streaming renders a few tile rows at a time and writes each band as soon as
+    // it is done, so only the band is ever held in memory
+    const int tileSize = renderTileSize(settings.mode);
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (height + tileSize - 1) / tileSize;
+    int bandRows = height;
+    if (config.stream) {
+        int tileRowsPerBand = std::max(1, (int)(pool.size() * 4 + tilesX - 1) / tilesX);
+        bandRows = std::min(height, tileRowsPerBand * tileSize);
+    }
+    
+    RenderProgress progress(tilesX * tilesY);
+    FrameStats stats(pool.size());
+    std::vector<uint32_t> costs(config.heatmap ? (size_t)width * height : 0);
+    TiledFramebuffer framebuffer;
+    if (config.stream) {
+        std::vector<Vector3> image((size_t)width * bandRows);
+        for (int y0 = 0; y0 < height; y0 += bandRows) {
+            int y1 = std::min(y0 + bandRows, height);
+            renderBand(pool, scene, camera, width, height, y0, y1, image.data(), progress,
+                       &stats, config.heatmap ? costs.data() + (size_t)y0 * width : nullptr, settings);
+            writer.writeRows(image.data(), y1 - y0);
+        }
+    } else {
+        // Whole frames go to a tiled framebuffer and are written out a tile row at a time
+        framebuffer.reset(width, height, tileSize, config.framebufferFormat);
+        settings.framebuffer = &framebuffer;
+        renderBand(pool, scene, camera, width, height, 0, height, nullptr, progress,
+                   &stats, config.heatmap ? costs.data() : nullptr, settings);
+        std::vector<Vector3> rows((size_t)width * tileSize);
+        for (int y0 = 0; y0 < height; y0 += tileSize) {
+            int rowCount = std::min(tileSize, height - y0);
+            framebuffer.readRows(y0, rowCount, rows.data());
+            writer.writeRows(rows.data(), rowCount);
+        }
+    }
+    
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    std::cerr << "\nRendering took " << duration.count() << " ms\n";
+    if (!config.stream) {
+        std::cerr << "Framebuffer: " << pixelFormatName(framebuffer.format()) << ", "
+                  << framebuffer.memoryBytes() / 1024 << " KB\n";
+    }
+#if RT_ENABLE_STATS
+    RayStats totals = stats.total();
+    std::cerr << "Rays: " << totals.primaryRays << " primary, " << totals.shadowRays << " shadow, "
+              << totals.reflectionRays << " reflection (" << totals.hits << " hits, " << totals.misses << " misses)\n"
+              << "Traversal: " << totals.nodeVisits << " node visits, " << totals.triangleTests << " triangle tests\n";
+    if (totals.allocations > 0) std::cerr << "Warning: render tiles made " << totals.allocations << " heap allocations\n";
+#endif
+
+    if (!gbufferPath.empty() && !gbuffer.valid) {
+        if (gbuffer.save(gbufferPath)) std::cerr << "Saved G-buffer " << gbufferPath << "\n";
+    }
+
+    if (config.heatmap) {
+#if !RT_ENABLE_STATS
+        std::cerr << "Built with RT_ENABLE_STATS=0, the heatmap will be empty\n";
+#endif
+        // Saved next to the image, output.ppm -> output_heat.ppm
+        std::string heatPath = config.outputPath == "-" ? "output" : config.outputPath;
+        if (heatPath.size() > 4 && heatPath.compare(heatPath.size() - 4, 4, ".ppm") == 0)
+            heatPath.resize(heatPath.size() - 4);
+        writeHeatmap(heatPath + "_heat.ppm", costs, width, height);
+    }
+
+    if (!writer.close()) {
+        std::cerr << "Error writing image: " << config.outputPath << "\n";
+        return 1;
+    }
+
+    std::cerr << "Rendering complete! Saved " << config.outputPath << "\n";
+    return 0;
+}
+
+// Drives Renderer the way an interactive preview would, one budgeted call per
+// displayed frame until the image is fully refined, then writes it out
+int renderPreview(const RenderConfig& config, const Scene& scene, ThreadPool& pool) {
+    const Camera camera = config.camera.camera();
+    Renderer renderer(pool, config.width, config.height, config.settings.maxSamples, config.settings.precision);
+    std::cerr << "Previewing " << config.width << "x" << config.height << " in calls of "
+              << config.previewBudgetMs << " ms on " << pool.size() << " threads...\n";
+    
+    double worstMs = 0;
+    for (int call = 1; ; call++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        Renderer::Progress progress = renderer.render(scene, camera, config.previewBudgetMs);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        worstMs = std::max(worstMs, ms);
+        std::cerr << "Call " << call << ": " << ms << " ms, ";
+        if (progress.stride > 1) std::cerr << "refining 1/" << progress.stride << " resolution\n";
+        else if (progress.samples == 0) std::cerr << "refining full resolution\n";
+        else std::cerr << progress.samples << " samples per pixel\n";
+        if (progress.finished) break;
+    }
+    std::cerr << "Slowest call took " << worstMs << " ms\n";
+    
+    PPMWriter writer;
+    if (!writer.open(config.outputPath, config.width, config.height, config.format)) return 1;
+    writer.writeRows(renderer.image().data(), config.height);
+    if (!writer.close()) {
+        std::cerr << "Error writing image: " << config.outputPath << "\n";
+        return 1;
+    }
+    std::cerr << "Rendering complete! Saved " << config.outputPath << "\n";
+    return 0;
+}
+
+// Writes finished frames on a thread of its own, so encoding and writing frame N
+// overlaps rendering frame N+1. At most one frame waits while another is written.
+class FrameWriter {
+public:
+    FrameWriter(int w, int h, ImageFormat fmt) : width(w), height(h), format(fmt), thread(&FrameWriter::run, this) {}
+    ~FrameWriter() { finish(); }
+    
+    // Takes the pixels and hands back a recycled buffer of the same size
+    void submit(const std::string& path, std::vector<Vector3>& pixels);
+    // Waits for the queued frames, returns false if any of them failed to write
+    bool finish();
+    
+private:
+    int width, height;
+    ImageFormat format;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool pending = false;
+    bool writing = false;
+    bool stopping = false;
+    bool failed = false;
+    std::string pendingPath;
+    std::vector<Vector3> pendingPixels;
+    std::vector<Vector3> spare;
+    std::thread thread;
+    
+    void run();
+};
+
+void FrameWriter::submit(const std::string& path, std::vector<Vector3>& pixels) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return !pending; });
+    pendingPath = path;
+    pendingPixels.swap(pixels);
+    pending = true;
+    pixels.swap(spare);
+    pixels.resize((size_t)width * height);
+    changed.notify_all();
+}
+
+void FrameWriter::run() {
+    std::vector<Vector3> pixels;
+    std::string path;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (writing) spare.swap(pixels); // The buffer just written goes back to submit()
+            writing = false;
+            changed.notify_all();
+            changed.wait(lock, [&] { return pending || stopping; });
+            if (!pending) return;
+            pixels.swap(pendingPixels);
+            path.swap(pendingPath);
+            pending = false;
+            writing = true;
+            changed.notify_all();
+        }
+        
+        PPMWriter writer;
+        bool ok = writer.open(path, width, height, format);
+        if (ok) {
+            writer.writeRows(pixels.data(), height);
+            ok = writer.close();
+            if (!ok) std::cerr << "Error writing image: " << path << "\n";
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = failed || !ok;
+    }
+}
+
+bool FrameWriter::finish() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return !pending && !writing; });
+        stopping = true;
+        changed.notify_all();
+    }
+    if (thread.joinable()) thread.join();
+    return !failed;
+}
+
+// output.ppm -> output_0001.ppm, or frame_###.ppm -> frame_001.ppm
+std::string framePath(const std::string& pattern, size_t frame) {
+    std::string number = std::to_string(frame + 1);
+    size_t hashes = pattern.find('#');
+    if (hashes != std::string::npos) {
+        size_t width = pattern.find_first_not_of('#', hashes);
+        width = (width == std::string::npos ? pattern.size() : width) - hashes;
+        if (number.size() < width) number.insert(0, width - number.size(), '0');
+        return pattern.substr(0, hashes) + number + pattern.substr(hashes + width);
+    }
+    if (number.size() < 4) number.insert(0, 4 - number.size(), '0');
+    size_t dot = pattern.rfind('.');
+    if (dot == std::string::npos || pattern.find('/', dot) != std::string::npos) return pattern + "_" + number;
+    return pattern.substr(0, dot) + "_" + number + pattern.substr(dot);
+}
+
+// Moves the objects' vertices to those of the frame's mesh files, which must
+// match the objects' topology. The i-th file goes to the i-th object that is not
+// instanced, placed the same way. Returns false, with the scene untouched, if
+// any file is missing or differs.
+bool loadFrameMeshes(const RenderConfig& config, const BatchFrame& frame, Scene& scene, ThreadPool& pool) {
+    std::vector<const ObjectConfig*> flatObjects;
+    for (const ObjectConfig& object : config.objects) {
+        if (!object.instanced) flatObjects.push_back(&object);
+    }
+    if (frame.meshes.size() > flatObjects.size()) {
+        std::cerr << "The frame lists " << frame.meshes.size() << " meshes for " << flatObjects.size() << " objects\n";
+        return false;
+    }
+    std::vector<Mesh> loaded(frame.meshes.size());
+    for (size_t i = 0; i < frame.meshes.size(); i++) {
+        const ObjectConfig& object = *flatObjects[i];
+        loaded[i] = loadOBJ(frame.meshes[i], 0, object.scale, object.offset, object.doubleSided, &pool);
+        if (loaded[i].indices != scene.meshes[i].indices) {
+            std::cerr << frame.meshes[i] << " does not have the topology of " << object.path << "\n";
+            return false;
+        }
+    }
+    for (size_t i = 0; i < loaded.size(); i++) scene.meshes[i].vertices.swap(loaded[i].vertices);
+    return true;
+}
+
+// Renders one image per configured frame pose with the scene, BVH and pool set
+// up once. Each frame is handed to a FrameWriter as soon as it is done.
+int renderBatch(const RenderConfig& config, Scene& scene, ThreadPool& pool) {
+    const int width = config.width;
+    const int height = config.height;
+    if (config.outputPath == "-") {
+        std::cerr << "Batch mode writes one file per frame, it can't write to stdout\n";
+        return 1;
+    }
+    if (config.stream || config.heatmap || !config.gbufferPath.empty())
+        std::cerr << "Streaming, heatmaps and the G-buffer are single image options, ignoring them for the batch\n";
+    
+    std::cerr << "Rendering " << config.frames.size() << " frames of " << width << "x" << height << " on "
+              << pool.size() << " threads (" << scene.bvh.kernelName() << " kernels)...\n";
+    
+    const int tileSize = renderTileSize(config.settings.mode);
+    const uint32_t tiles = ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+    FrameWriter writer(width, height, config.format);
+    FrameStats stats(pool.size());
+    std::vector<Vector3> image((size_t)width * height);
+    
+    auto start = std::chrono::high_resolution_clock::now();
+    double refitMs = 0;
+    for (size_t f = 0; f < config.frames.size(); f++) {
+        auto frameStart = std::chrono::high_resolution_clock::now();
+        if (!config.frames[f].meshes.empty()) {
+            if (scene.bvh.isCompressed()) {
+                std::cerr << "Animated frames refit the binary BVH, they can't be used with --compress\n";
+                writer.finish();
+                return 1;
+            }
+            if (!loadFrameMeshes(config, config.frames[f], scene, pool)) {
+                writer.finish();
+                return 1;
+            }
+            auto refitStart = std::chrono::high_resolution_clock::now();
+            BVHRefitStats refit = scene.refit(&pool);
+            double ms = elapsedMs(refitStart);
+            refitMs += ms;
+            std::cerr << "Frame " << f + 1 << " refitted in " << ms << " ms, SAH cost " << refit.builtSahCost
+                      << " -> " << refit.refitSahCost;
+            if (refit.rebuiltSubtrees > 0)
+                std::cerr << ", rebuilt " << refit.rebuiltSubtrees << " subtrees (" << refit.rebuiltPrims
+                          << " triangles) -> " << refit.sahCost;
+            std::cerr << "\n";
+        }
+        auto renderStart = std::chrono::high_resolution_clock::now();
+        RenderProgress progress(tiles, false);
+        renderBand(pool, scene, config.frames[f].camera(), width, height, 0, height, image.data(), progress,
+                   &stats, nullptr, config.settings);
+        std::string path = framePath(config.outputPath, f);
+        std::cerr << "Frame " << f + 1 << "/" << config.frames.size() << " rendered in "
+                  << (int64_t)elapsedMs(renderStart) << " ms (" << (int64_t)elapsedMs(frameStart)
+                  << " ms in all) -> " << path << "\n";
+        writer.submit(path, image);
+    }
+    bool ok = writer.finish();
+    
+    double totalMs = elapsedMs(start);
+    std::cerr << "Batch took " << (int64_t)totalMs << " ms, "
+              << (int64_t)(totalMs / std::max<size_t>(1, config.frames.size())) << " ms per frame";
+    if (refitMs > 0) std::cerr << ", " << refitMs << " ms of it refitting";
+    std::cerr << "\n";
+#if RT_ENABLE_STATS
+    RayStats totals = stats.total();
+    std::cerr << "Rays: " << totals.primaryRays << " primary, " << totals.shadowRays << " shadow, "
+              << totals.reflectionRays << " reflection\n";
+    if (totals.allocations > 0) std::cerr << "Warning: render tiles made " << totals.allocations << " heap allocations\n";
+#endif
+    return ok ? 0 : 1;
+}
+
+// Distributed rendering. A coordinator (--coordinator PORT) leases row bands of
+// the frame to worker processes (--worker HOST:PORT) and renders bands itself
+// too. Every worker sets up the scene from its own arguments, normally through
+// the same scene cache, and proves it matches with the job key before getting
+// any work. The messages are raw structs, so all nodes need the same byte
+// order and float format, as with the cache files.
+const uint32_t DISTRIBUTED_MAGIC = 0x4a445452; // "RTDJ"
+const uint32_t DISTRIBUTED_VERSION = 1;
+const int DISTRIBUTED_BAND_ROWS = 64;
+const int MAX_BAND_COPIES = 2; // Leases of one band out at once, see LeaseTable
+
+struct WorkerHello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t jobKey;
+};
+
+// Coordinator to worker. y0 < 0 ends the session: BAND_DONE once the frame is
+// complete, BAND_REJECTED when the worker's job key does not match.
+struct BandLease {
+    uint32_t magic;
+    int32_t y0, y1;
+};
+const int32_t BAND_DONE = -1;
+const int32_t BAND_REJECTED = -2;
+
+// Worker to coordinator, followed by width * (y1 - y0) pixels
+struct BandResult {
+    uint32_t magic;
+    int32_t y0, y1;
+};
+
+// Everything that decides the pixels: geometry and camera as for the G-buffer,
+// plus the lights, materials and sampling settings
+uint64_t jobKey(const Scene& scene, const Camera& camera, int width, int height, const RenderSettings& settings) {
+    uint64_t h = gbufferKey(scene, camera, width, height);
+    for (const Light& light : scene.shading.lights) h = hashBytes(h, &light, sizeof(light));
+    h = hashBytes(h, &scene.shading.ambientStrength, sizeof(float));
+    h = hashBytes(h, &scene.shading.specularStrength, sizeof(float));
+    h = hashBytes(h, &scene.shading.lightSamples, sizeof(int));
+    h = hashBytes(h, scene.materials.data(), scene.materials.size() * sizeof(Material));
+    h = hashBytes(h, &settings.mode, sizeof(settings.mode));
+    h = hashBytes(h, &settings.maxSamples, sizeof(int));
+    h = hashBytes(h, &settings.minSamples, sizeof(int));
+    h = hashBytes(h, &settings.samplesPerPass, sizeof(int));
+    h = hashBytes(h, &settings.varianceThreshold, sizeof(float));
+    return hashBytes(h, &settings.precision, sizeof(settings.precision));
+}
+
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+const SocketHandle NO_SOCKET = INVALID_SOCKET;
+#else
+typedef int SocketHandle;
+const SocketHandle NO_SOCKET = -1;
+#endif
+
+// A blocking TCP socket, closed on destruction
+class Socket {
+public:
+    Socket() = default;
+    explicit Socket(SocketHandle h) : handle(h) {}
+    Socket(Socket&& other) noexcept : handle(other.handle) { other.handle = NO_SOCKET; }
+    Socket& operator=(Socket&& other) noexcept { std::swap(handle, other.handle); return *this; }
+    ~Socket() { close(); }
+    
+    // Once per process before any socket is made
+    static bool startup();
+    
+    bool connect(const std::string& host, const std::string& port);
+    bool listen(const std::string& port);
+    // Waits up to timeoutMs for a connection, returns an invalid socket if none came
+    Socket accept(int timeoutMs);
+    bool sendAll(const void* data, size_t size);
+    bool receiveAll(void* data, size_t size);
+    // Wakes a thread blocked on this socket from another one; only the owner closes
+    void shutdown();
+    void close();
+    bool valid() const { return handle != NO_SOCKET; }
+    
+private:
+    SocketHandle handle = NO_SOCKET;
+};
+
+bool Socket::startup() {
+#ifdef _WIN32
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+    return true;
+#endif
+}
+
+bool Socket::connect(const std::string& host, const std::string& port) {
+    close();
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) return false;
+    for (addrinfo* a = addresses; a && !valid(); a = a->ai_next) {
+        handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (valid() && ::connect(handle, a->ai_addr, (int)a->ai_addrlen) != 0) close();
+    }
+    freeaddrinfo(addresses);
+    if (!valid()) return false;
+    
+    // Leases are tiny and wait on nothing else
+    int on = 1;
+    setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(handle, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&on, sizeof(on));
+#endif
+    return true;
+}
+
+bool Socket::listen(const std::string& port) {
+    close();
+    addrinfo hints = {};
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(nullptr, port.c_str(), &hints, &addresses) != 0) {
+        hints.ai_family = AF_INET; // No IPv6 on this host
+        if (getaddrinfo(nullptr, port.c_str(), &hints, &addresses) != 0) return false;
+    }
+    handle = ::socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+    if (valid()) {
+        int on = 1, off = 0;
+        setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+        // Take IPv4 workers on the IPv6 socket too
+        if (addresses->ai_family == AF_INET6) setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&off, sizeof(off));
+        if (::bind(handle, addresses->ai_addr, (int)addresses->ai_addrlen) != 0 || ::listen(handle, 64) != 0) close();
+    }
+    freeaddrinfo(addresses);
+    return valid();
+}
+
+Socket Socket::accept(int timeoutMs) {
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(handle, &ready);
+    timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+    if (select((int)handle + 1, &ready, nullptr, nullptr, &timeout) <= 0) return Socket();
+    Socket client(::accept(handle, nullptr, nullptr));
+    if (client.valid()) {
+        int on = 1;
+        setsockopt(client.handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+        setsockopt(client.handle, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&on, sizeof(on));
+#endif
+    }
+    return client;
+}
+
+bool Socket::sendAll(const void* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL; // A dropped peer is an error, not a SIGPIPE
+#else
+    const int flags = 0;
+#endif
+    const char* p = (const char*)data;
+    while (size > 0) {
+        int chunk = (int)std::min<size_t>(size, 1 << 30);
+        auto sent = ::send(handle, p, chunk, flags);
+        if (sent <= 0) return false;
+        p += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+bool Socket::receiveAll(void* data, size_t size) {
+    char* p = (char*)data;
+    while (size > 0) {
+        int chunk = (int)std::min<size_t>(size, 1 << 30);
+        auto received = ::recv(handle, p, chunk, 0);
+        if (received <= 0) return false;
+        p += received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+void Socket::shutdown() {
+#ifdef _WIN32
+    if (valid()) ::shutdown(handle, SD_BOTH);
+#else
+    if (valid()) ::shutdown(handle, SHUT_RDWR);
+#endif
+}
+
+void Socket::close() {
+    if (!valid()) return;
+#ifdef _WIN32
+    closesocket(handle);
+#else
+    ::close(handle);
+#endif
+    handle = NO_SOCKET;
+}
+
+// Which bands of a distributed frame are done and how many copies of each are
+// out. Bands are leased in order. Once none is left unleased, an idle renderer
+// gets another copy of the open band leased longest ago, so a slow or stuck
+// worker cannot hold up the frame; the first copy back goes into the image.
+class LeaseTable {
+public:
+    LeaseTable(int height, int bandRows) : rows(bandRows), bands((height + bandRows - 1) / bandRows),
+                                          remaining((int)bands.size()) {}
+    
+    int bandCount() const { return (int)bands.size(); }
+    int bandRows() const { return rows; }
+    
+    // Next band to render, false once every band is stored. Waits while all
+    // open bands already have MAX_BAND_COPIES leases out.
+    bool lease(int& band);
+    // Ends a lease with finished pixels. Returns true if this copy is the first
+    // back: the caller then copies it into the image and calls stored().
+    bool claim(int band);
+    void stored();
+    // Ends a lease without pixels, when its renderer dropped out
+    void release(int band);
+    // Copies that came back after another one, for the summary
+    int discardedCopies() const { return discarded; }
+    bool done() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return remaining == 0;
+    }
+    
+private:
+    struct Band {
+        int leases = 0;
+        bool claimed = false;
+        std::chrono::steady_clock::time_point leasedAt;
+    };
+    
+    int rows;
+    std::vector<Band> bands;
+    int remaining;
+    int discarded = 0;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+bool LeaseTable::lease(int& band) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        if (remaining == 0) return false;
+        int straggler = -1;
+        for (int b = 0; b < (int)bands.size(); b++) {
+            const Band& candidate = bands[b];
+            if (candidate.claimed || candidate.leases >= MAX_BAND_COPIES) continue;
+            if (candidate.leases == 0) {
+                straggler = b;
+                break;
+            }
+            if (straggler < 0 || candidate.leasedAt < bands[straggler].leasedAt) straggler = b;
+        }
+        if (straggler >= 0) {
+            band = straggler;
+            bands[band].leases++;
+            bands[band].leasedAt = std::chrono::steady_clock::now();
+            return true;
+        }
+        changed.wait(lock);
+    }
+}
+
+bool LeaseTable::claim(int band) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bands[band].leases--;
+    if (bands[band].claimed) {
+        discarded++;
+        changed.notify_all();
+        return false;
+    }
+    bands[band].claimed = true;
+    return true;
+}
+
+void LeaseTable::stored() {
+    std::lock_guard<std::mutex> lock(mutex);
+    remaining--;
+    changed.notify_all();
+}
+
+void LeaseTable::release(int band) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bands[band].leases--;
+    changed.notify_all();
+}
+
+// Serves one worker connection until the frame is done or the worker drops out
+void serveWorker(Socket& socket, LeaseTable& table, uint64_t key, int width, int height, std::vector<Vector3>& image,
+                 std::atomic<int>& remoteBands) {
+    WorkerHello hello;
+    if (!socket.receiveAll(&hello, sizeof(hello)) || hello.magic != DISTRIBUTED_MAGIC) return;
+    if (hello.version != DISTRIBUTED_VERSION || hello.jobKey != key) {
+        std::cerr << "\nRejected a worker set up for a different scene, camera or render settings\n";
+        BandLease reject = { DISTRIBUTED_MAGIC, BAND_REJECTED, BAND_REJECTED };
+        socket.sendAll(&reject, sizeof(reject));
+        return;
+    }
+    
+    std::vector<Vector3> pixels;
+    int band;
+    while (table.lease(band)) {
+        int y0 = band * table.bandRows();
+        BandLease lease = { DISTRIBUTED_MAGIC, y0, std::min(y0 + table.bandRows(), height) };
+        
+        BandResult result;
+        pixels.resize((size_t)width * (lease.y1 - y0));
+        bool ok = socket.sendAll(&lease, sizeof(lease)) && socket.receiveAll(&result, sizeof(result)) &&
+                  result.magic == DISTRIBUTED_MAGIC && result.y0 == lease.y0 && result.y1 == lease.y1 &&
+                  socket.receiveAll(pixels.data(), pixels.size() * sizeof(Vector3));
+        if (!ok) {
+            table.release(band);
+            return;
+        }
+        if (table.claim(band)) {
+            std::copy(pixels.begin(), pixels.end(), image.begin() + (size_t)y0 * width);
+            remoteBands++;
+            table.stored();
+        }
+    }
+    BandLease done = { DISTRIBUTED_MAGIC, BAND_DONE, BAND_DONE };
+    socket.sendAll(&done, sizeof(done));
+}
+
+// Coordinator: renders the frame with every worker that connects to port,
+// rendering bands on this machine's threads as well, then writes the image
+int renderCoordinator(const RenderConfig& config, const Scene& scene, ThreadPool& pool) {
+    const int width = config.width;
+    const int height = config.height;
+    const Camera camera = config.camera.camera();
+    if (config.stream || config.heatmap || !config.gbufferPath.empty())
+        std::cerr << "Streaming, heatmaps and the G-buffer are local options, ignoring them for the distributed frame\n";
+    
+    Socket listener;
+    if (!Socket::startup() || !listener.listen(config.coordinatorPort)) {
+        std::cerr << "Could not listen for workers on port " << config.coordinatorPort << "\n";
+        return 1;
+    }
+    PPMWriter writer;
+    if (!writer.open(config.outputPath, width, height, config.format)) return 1;
+    
+    const uint64_t key = jobKey(scene, camera, width, height, config.settings);
+    LeaseTable table(height, DISTRIBUTED_BAND_ROWS);
+    std::vector<Vector3> image((size_t)width * height);
+    std::atomic<int> remoteBands(0);
+    std::cerr << "Rendering " << width << "x" << height << " image in " << table.bandCount()
+              << " bands, waiting for workers on port " << config.coordinatorPort << "...\n";
+    auto start = std::chrono::high_resolution_clock::now();
+    
+    // Accepts workers until the frame is done. Each one gets a thread that
+    // mostly waits on its socket.
+    std::deque<Socket> sockets;
+    std::vector<std::thread> sessions;
+    std::mutex sessionMutex;
+    std::thread acceptor([&]() {
+        while (!table.done()) {
+            Socket client = listener.accept(100);
+            if (!client.valid()) continue;
+            std::lock_guard<std::mutex> lock(sessionMutex);
+            sockets.push_back(std::move(client));
+            Socket& socket = sockets.back();
+            sessions.emplace_back([&, &socket = socket]() { serveWorker(socket, table, key, width, height, image, remoteBands); });
+        }
+    });
+    
+    // This machine is a renderer like any other
+    FrameStats stats(pool.size());
+    std::vector<Vector3> band((size_t)width * DISTRIBUTED_BAND_ROWS);
+    int localBands = 0;
+    int b;
+    while (table.lease(b)) {
+        int y0 = b * DISTRIBUTED_BAND_ROWS;
+        int y1 = std::min(y0 + DISTRIBUTED_BAND_ROWS, height);
+        RenderProgress progress(0, false);
+        renderBand(pool, scene, camera, width, height, y0, y1, band.data(), progress, &stats, nullptr, config.settings);
+        if (table.claim(b)) {
+            std::copy(band.begin(), band.begin() + (size_t)width * (y1 - y0), image.begin() + (size_t)y0 * width);
+            localBands++;
+            table.stored();
+        }
+        std::cerr << "Bands: " << localBands + remoteBands << "/" << table.bandCount() << "\r";
+    }
+    
+    // Stragglers still rendering a band that came back from elsewhere are cut off
+    acceptor.join();
+    for (Socket& socket : sockets) socket.shutdown();
+    for (std::thread& session : sessions) session.join();
+    
+    std::cerr << "\nRendering took " << (int64_t)elapsedMs(start) << " ms: " << localBands << " bands here, "
+              << remoteBands << " from " << sessions.size() << " workers, " << table.discardedCopies()
+              << " duplicate copies dropped\n";
+    writer.writeRows(image.data(), height);
+    if (!writer.close()) {
+        std::cerr << "Error writing image: " << config.outputPath << "\n";
+        return 1;
+    }
+    std::cerr << "Rendering complete! Saved " << config.outputPath << "\n";
+    return 0;
+}
+
+// Worker: renders the bands the coordinator at HOST:PORT leases out. Retries
+// the connection for a while, so workers may be started before the coordinator.
+int renderWorker(const RenderConfig& config, const Scene& scene, ThreadPool& pool) {
+    size_t colon = config.workerAddress.rfind(':');
+    if (colon == std::string::npos) {
+        std::cerr << "--worker takes HOST:PORT\n";
+        return 1;
+    }
+    std::string host = config.workerAddress.substr(0, colon);
+    std::string port = config.workerAddress.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    
+    Socket socket;
+    bool connected = Socket::startup();
+    for (int attempt = 0; connected && !socket.connect(host, port); attempt++) {
+        if (attempt == 60) connected = false;
+        else std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    if (!connected) {
+        std::cerr << "Could not reach the coordinator at " << config.workerAddress << "\n";
+        return 1;
+    }
+    
+    const int width = config.width;
+    const int height = config.height;
+    const Camera camera = config.camera.camera();
+    WorkerHello hello = { DISTRIBUTED_MAGIC, DISTRIBUTED_VERSION, jobKey(scene, camera, width, height, config.settings) };
+    if (!socket.sendAll(&hello, sizeof(hello))) return 1;
+    std::cerr << "Connected to " << config.workerAddress << ", rendering on " << pool.size() << " threads\n";
+    
+    FrameStats stats(pool.size());
+    std::vector<Vector3> band;
+    int bands = 0;
+    BandLease lease = {};
+    while (socket.receiveAll(&lease, sizeof(lease)) && lease.magic == DISTRIBUTED_MAGIC && lease.y0 >= 0) {
+        if (lease.y1 <= lease.y0 || lease.y1 > height) return 1;
+        band.resize((size_t)width * (lease.y1 - lease.y0));
+        RenderProgress progress(0, false);
+        renderBand(pool, scene, camera, width, height, lease.y0, lease.y1, band.data(), progress, &stats, nullptr,
+                   config.settings);
+        BandResult result = { DISTRIBUTED_MAGIC, lease.y0, lease.y1 };
+        if (!socket.sendAll(&result, sizeof(result)) || !socket.sendAll(band.data(), band.size() * sizeof(Vector3))) break;
+        bands++;
+    }
+    if (lease.magic == DISTRIBUTED_MAGIC && lease.y0 == BAND_REJECTED) {
+        std::cerr << "The coordinator renders a different scene, camera or settings; check both command lines\n";
+        return 1;
+    }
+    std::cerr << "Rendered " << bands << " bands, frame done\n";
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    RenderConfig config;
+    bool benchmark = false;
+    if (!parseArgs(argc, argv, config, benchmark)) return 1;
+    if (benchmark) return runBenchmark(config.objects[0].path);
+    
+    ThreadPool pool(config.threads);
+    Scene scene;
+    bool distributed = !config.coordinatorPort.empty() || !config.workerAddress.empty();
+    if (distributed && !config.frames.empty()) {
+        std::cerr << "Distributed rendering takes a single image, not a batch of frames\n";
+        return 1;
+    }
+    setupScene(config, scene, pool);
+    if (!config.workerAddress.empty()) return renderWorker(config, scene, pool);
+    if (!config.coordinatorPort.empty()) return renderCoordinator(config, scene, pool);
+    if (!config.frames.empty()) return renderBatch(config, scene, pool);
+    if (config.previewBudgetMs > 0) return renderPreview(config, scene, pool);
+    return renderImage(config, scene, pool);
+}